@@ -10,6 +10,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <endian.h>
+#include <time.h>
 #include "miniaudio.h"
 #include "miniaudio.c"
 #include "cpu.h"
@@ -24,6 +25,22 @@
 #define AUDIO_BUF_NUM_FRAMES    (1800*4)
 #define AUDIO_BUF_NUM_SAMPLES   (AUDIO_BUF_NUM_FRAMES * DEVICE_CHANNELS)
 #define ADUIO_SAMPLE_DIVIDER    (CLK_HZ / DEVICE_SAMPLE_RATE)
+#define AUDIO_SYNC_MAX_FRAMES   2400 // with audio sync, emulation waits while more than 50ms of audio is buffered
+#define AUDIO_SYNC_WAIT_NS      500000
+#define STRETCH_WINDOW          960 // frames in each overlapped segment of the time stretcher, 20ms
+#define STRETCH_HOP             (STRETCH_WINDOW/2) // frames output per segment
+#define STRETCH_SEEK            240 // furthest a segment may move to line up with the one before it
+#define STRETCH_SEEK_STEP       4 // segments are compared on every 4th frame
+#define STRETCH_MAX_SPEED       8.0 // above this, whole segments are dropped instead
+#define STRETCH_INPUT_FRAMES    8192
+#define BLIP_TAPS               16 // output samples each band-limited step is spread over
+#define BLIP_PHASE_BITS         5
+#define BLIP_PHASES             (1<<BLIP_PHASE_BITS) // positions between two output samples a step can start at
+#define BLIP_FRAC_BITS          32 // fixed point bits of blip_position below one output sample
+#define BLIP_CUTOFF             0.9 // fraction of the output's Nyquist frequency kept by each step
+#define BLIP_FLUSH_FRAMES       512 // finished samples are output once this many are waiting
+#define BLIP_BUFFER_FRAMES      1024
+#define APU_MAX_STEP            8192 // longest run of cycles the APU skips over without ticking, about 94 samples
 
 #define WAV_SAMPLE_RATE         65536
 #define WAV_BITS_PER_SAMPLE     8
@@ -35,12 +52,21 @@
 
 extern uint8_t* ram;
 extern uint16_t system_counter;
+extern uint64_t cycles_run;
+extern bool stop_mode;
+extern bool no_audio;
+extern bool audio_sync;
+extern bool hyperspeed;
+extern double emulation_speed;
 static uint8_t div_apu = 1;
 static bool last_div_bit = 0;
-static uint16_t gb_sample_index = 0;
 static double capacitors[DEVICE_CHANNELS] = {0.0};
 static uint16_t audio_sample_divider = ADUIO_SAMPLE_DIVIDER + 1;
+static uint64_t apu_cycles = 0; // cycles the APU has run for, which may be behind cycles_run
+static bool wave_refresh = 0; // the wave and noise channels recompute their sample on their next tick
+static bool noise_refresh = 0;
 bool do_export_wav = 0; //extern
+bool audio_muted = 0; //extern, channels still run but no samples are output
 static uint64_t wav_frames_written = 0;
 
 static uint16_t REG_NRx1[4] = {REG_NR11,REG_NR21,REG_NR31,REG_NR41};
@@ -65,8 +91,30 @@ static float audio_buffer[AUDIO_BUF_NUM_SAMPLES];
 
 uint64_t frames_written = 0;
 
+static float stretch_input[STRETCH_INPUT_FRAMES][DEVICE_CHANNELS]; // audio waiting to be time stretched
+static uint32_t stretch_input_frames = 0;
+static double stretch_position = STRETCH_SEEK; // start of the next segment in stretch_input, before it is moved to line up
+static int32_t segment_target = -1; // where the last segment output would have carried on in stretch_input, -1 before the first
+static float stretch_overlap[STRETCH_HOP][DEVICE_CHANNELS]; // windowed second half of the last segment
+static float stretch_window[STRETCH_WINDOW];
+static bool stretching = 0;
+
+static float blip_kernel[BLIP_PHASES][BLIP_TAPS]; // band-limited impulse starting at each phase, each summing to 1
+static float blip_deltas[BLIP_BUFFER_FRAMES + BLIP_TAPS][DEVICE_CHANNELS]; // level changes, spread over the samples around them
+static float blip_levels[DEVICE_CHANNELS] = {0}; // mixed level of each device channel after every change so far
+static float blip_sums[DEVICE_CHANNELS] = {0}; // running sum of the deltas already output
+static uint64_t blip_position = 0; // output position of blip_cycle in samples from the start of blip_deltas, as BLIP_FRAC_BITS fixed point
+static uint64_t blip_cycle = 0;
+static uint64_t blip_step = 0; // output samples per cycle, as BLIP_FRAC_BITS fixed point
+
 FILE* raw_audio_file;
 
+
+static inline uint32_t get_buffered_frames(void) {
+    /* number of frames written to the audio buffer and not yet copied to the device */
+    return ((AUDIO_BUF_NUM_SAMPLES + buf_writepos - buf_readpos) % AUDIO_BUF_NUM_SAMPLES) / 2;
+}
+
 void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount) {
     /* callback routine for miniaudio. This function is automatically called when
     the audio engine is running out of samples, to allow the main thread to copy
@@ -77,10 +125,10 @@ void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uin
 
     float* pFramesOutF32 = (float*)pOutput;
     frames_written = 0;
-    ma_uint64 buffered_frames = ((AUDIO_BUF_NUM_SAMPLES + buf_writepos - buf_readpos) % AUDIO_BUF_NUM_SAMPLES) / 2;
+    ma_uint64 buffered_frames = get_buffered_frames();
     if (frameCount > buffered_frames) frameCount = buffered_frames;
 
-    if (buffered_frames) {
+    if (buffered_frames && !audio_sync) { // with audio sync, emulation follows the device instead
         if (buffered_frames > (AUDIO_BUF_NUM_FRAMES * 2) / 3) {
             audio_sample_divider = ADUIO_SAMPLE_DIVIDER + 2;
         } else if (buffered_frames > (AUDIO_BUF_NUM_FRAMES) / 3) {
@@ -152,6 +200,26 @@ static inline void wav_write_sample(void) {
 }
 
 
+static void init_blip_kernel(void) {
+    /* precompute the band-limited impulse for a step starting at each phase between two output samples.
+    Each is a Blackman windowed sinc centred BLIP_TAPS/2 samples after the step, so adding up a run of
+    them gives the step without the frequencies above the output's Nyquist limit that would alias */
+    for (int phase=0; phase<BLIP_PHASES; phase++) {
+        double kernel[BLIP_TAPS];
+        double sum = 0;
+        for (int i=0; i<BLIP_TAPS; i++) {
+            double t = i - BLIP_TAPS/2 - (double)phase / BLIP_PHASES; // samples from the centre of the impulse
+            double x = M_PI * BLIP_CUTOFF * t;
+            double window = 0.42 + 0.5*cos(2*M_PI*t / BLIP_TAPS) + 0.08*cos(4*M_PI*t / BLIP_TAPS);
+            if (t <= -BLIP_TAPS/2) window = 0;
+            kernel[i] = (x == 0 ? 1.0 : sin(x) / x) * window;
+            sum += kernel[i];
+        }
+        for (int i=0; i<BLIP_TAPS; i++) blip_kernel[phase][i] = kernel[i] / sum;
+    }
+}
+
+
 void init_audio(void) {
     /* initialise the audio controller */
     ma_device_config device_config;
@@ -179,6 +247,8 @@ void init_audio(void) {
     }
 
     memset(channels, 0, sizeof(channel_attributes) * GAMEBOY_CHANNELS); // init channels attrs to 0
+    for (int i=0; i<STRETCH_WINDOW; i++) stretch_window[i] = 0.5 - 0.5*cos(2*M_PI*i / STRETCH_WINDOW); // halves overlapped by STRETCH_HOP sum to 1
+    init_blip_kernel();
 
     if (do_export_wav) open_wav_file();
 }
@@ -209,14 +279,14 @@ void close_audio(void) {
 static inline void event_length(void) {
     /* process the ticking of the length timer */
     for (uint8_t i=0; i<4; i+=i+1) { // sequence 0,1,3 for pulse channels and wave.
-        if ((read_byte(REG_NR52)&(1<<i)) && (read_byte(REG_NRx4[i])&0x40)) { // is channel i on and length enabled?
+        if ((*(ram+REG_NR52)&(1<<i)) && (*(ram+REG_NRx4[i])&0x40)) { // is channel i on and length enabled?
             channels[i].length_timer++;
             if (channels[i].length_timer >= 64) {
                 *(ram+REG_NR52) &= ~(1<<i); // disable channel i
             }
         }
     }
-    if ((read_byte(REG_NR52)&(1<<2)) && (read_byte(REG_NRx4[2])&0x40)) { // is channel 2 on and length enabled?
+    if ((*(ram+REG_NR52)&(1<<2)) && (*(ram+REG_NRx4[2])&0x40)) { // is channel 2 on and length enabled?
         channels[2].length_timer++;
         if (channels[2].length_timer >= 256) {
             *(ram+REG_NR52) &= ~(1<<2); // disable channel 2
@@ -227,7 +297,7 @@ static inline void event_length(void) {
 
 static inline void event_ch1_freq_sweep(void) {
     /* process the ticking of channel 1's frequency sweep */
-    if (read_byte(REG_NR52)&1) { // is channel on?
+    if (*(ram+REG_NR52)&1) { // is channel on?
         uint8_t step = *(ram+REG_NR10)&7;
         bool direction = *(ram+REG_NR10)&8;
         uint8_t pace = (*(ram+REG_NR10)>>4)&7;
@@ -264,7 +334,7 @@ static inline void event_ch1_freq_sweep(void) {
 static inline void event_envelope_sweep(void) {
     /* process the ticking of the amplitude envelope */
     for (uint8_t i=0; i<4; i+=i+1) { // sequence 0,1,3 for pulse channels and wave.
-        if ((read_byte(REG_NR52)&(1<<i)) && (channels[i].amp_sweep_attrs&7)) { // is channel i on and sweep not 0 ?
+        if ((*(ram+REG_NR52)&(1<<i)) && (channels[i].amp_sweep_attrs&7)) { // is channel i on and sweep not 0 ?
             channels[i].amp_sweep_timer++;
             if (channels[i].amp_sweep_timer >= (channels[i].amp_sweep_attrs&7)) { // sweep pace
                 channels[i].amp_sweep_timer = 0;
@@ -294,57 +364,203 @@ static inline void write_to_buf(float val) {
 }
 
 
-static inline void queue_sample(void) {
-    /* queue the current sample into the buffer to be copied by the miniaudio callback.
+static float segment_match(uint32_t candidate, uint32_t target) {
+    /* score how well the segment starting at candidate continues on from the audio at target,
+    as their correlation normalised by the candidate's energy */
+    float correlation = 0, energy = 1e-9;
+    for (uint32_t i=0; i<STRETCH_HOP; i+=STRETCH_SEEK_STEP) {
+        float a = stretch_input[candidate+i][0] + stretch_input[candidate+i][1];
+        float b = stretch_input[target+i][0] + stretch_input[target+i][1];
+        correlation += a * b;
+        energy += a * a;
+    }
+    return correlation / sqrtf(energy);
+}
+
+
+static void reset_stretcher(void) {
+    /* discard audio waiting to be time stretched */
+    stretch_input_frames = 0;
+    stretch_position = STRETCH_SEEK;
+    segment_target = -1;
+    memset(stretch_overlap, 0, sizeof(stretch_overlap));
+}
+
+
+static void stretch_segment(double speed) {
+    /* output one segment of time stretched audio. WSOLA: segments are taken from the input
+    speed times further apart than they are output, and each is moved by up to STRETCH_SEEK frames
+    to where it best continues the previous segment, so overlapping them does not cancel the waveform */
+    uint32_t start = (uint32_t)stretch_position;
+    if (segment_target != -1) {
+        float best_score = -INFINITY;
+        uint32_t best_start = start;
+        for (uint32_t candidate = start-STRETCH_SEEK; candidate <= start+STRETCH_SEEK; candidate++) {
+            float score = segment_match(candidate, segment_target);
+            if (score > best_score) {
+                best_score = score;
+                best_start = candidate;
+            }
+        }
+        start = best_start;
+    }
+
+    // far ahead of the device, such as when uncapped beyond STRETCH_MAX_SPEED, whole segments are dropped
+    bool drop = get_buffered_frames() > (AUDIO_BUF_NUM_FRAMES * 2) / 3;
+    for (uint32_t i=0; i<STRETCH_HOP; i++) {
+        for (uint8_t j=0; j<DEVICE_CHANNELS; j++) {
+            if (!drop) write_to_buf(stretch_overlap[i][j] + stretch_window[i] * stretch_input[start+i][j]);
+            stretch_overlap[i][j] = stretch_window[STRETCH_HOP+i] * stretch_input[start+STRETCH_HOP+i][j];
+        }
+    }
+    segment_target = start + STRETCH_HOP;
+    stretch_position += STRETCH_HOP * speed;
+
+    // move the audio still needed to the start of the input
+    uint32_t keep_from = (uint32_t)stretch_position - STRETCH_SEEK;
+    if (keep_from > (uint32_t)segment_target) keep_from = segment_target;
+    memmove(stretch_input, stretch_input[keep_from], sizeof(stretch_input[0]) * (stretch_input_frames - keep_from));
+    stretch_input_frames -= keep_from;
+    stretch_position -= keep_from;
+    segment_target -= keep_from;
+}
+
+
+static void stretch_sample(float* samples) {
+    /* time stretch audio while emulation runs faster than normal, so it plays at the device's rate
+    with its pitch unchanged. At normal speed, audio is written straight to the buffer */
+    double speed = emulation_speed;
+    if (speed < 1.0) speed = 1.0;
+    if (speed > STRETCH_MAX_SPEED) speed = STRETCH_MAX_SPEED;
+    if (!stretching) {
+        reset_stretcher();
+        stretching = 1;
+    }
+    memcpy(stretch_input[stretch_input_frames++], samples, sizeof(stretch_input[0]));
+    if (stretch_position + STRETCH_SEEK + STRETCH_WINDOW <= stretch_input_frames) {
+        stretch_segment(speed);
+        if (emulation_speed <= 1.0) { // the last segment fades out, and output continues unstretched
+            for (uint32_t i=0; i<STRETCH_HOP; i++) {
+                for (uint8_t j=0; j<DEVICE_CHANNELS; j++) write_to_buf(stretch_overlap[i][j]);
+            }
+            stretching = 0;
+        }
+    }
+}
+
+
+static inline void mix_levels(float* levels) {
+    /* mix the channels into the level of each device channel, before the high-pass filter.
     For each enabled DAC, perform the following:
     Translate each channels sample [0, F] to an analog signal [1, -1]
     Combine each analog sample into a left and right channel, as determined by NR51
     Scale left and right channels by NR50
-    Apply High-Pass Filter
-    Add to buffer
     */
-    float samples[DEVICE_CHANNELS] = {0,0};
     bool dac_state[GAMEBOY_CHANNELS] = {
-        read_byte(REG_NR12) & 0xF8,
-        read_byte(REG_NR22) & 0xF8,
-        read_byte(REG_NR30) & 128,
-        read_byte(REG_NR42) & 0xF8
+        *(ram+REG_NR12) & 0xF8,
+        *(ram+REG_NR22) & 0xF8,
+        *(ram+REG_NR30) & 128,
+        *(ram+REG_NR42) & 0xF8
     };
     float curr_sample;
+    levels[0] = levels[1] = 0;
     for (uint8_t i=0; i<GAMEBOY_CHANNELS; i++) {
         if (dac_state[i]) {
             curr_sample = ((float)channels[i].sample_state / 30.0) - 0.25; // scale to [-0.25, 0.25]
-            if (read_byte(REG_NR51) & 1 << i    ) samples[0] += curr_sample; // right
-            if (read_byte(REG_NR51) & 1 << (i+4)) samples[1] += curr_sample; // left
+            if (*(ram+REG_NR51) & 1 << i    ) levels[0] += curr_sample; // right
+            if (*(ram+REG_NR51) & 1 << (i+4)) levels[1] += curr_sample; // left
         }
     }
 
-    // at this point, each device channel's sample is in the range [-1,1]
+    // at this point, each device channel's level is in the range [-1,1]
 
     for (uint8_t i=0; i<DEVICE_CHANNELS; i++) {
-        samples[i] *= (float)(((read_byte(REG_NR50) >> (4*i)) & 7) + 1) / 8.0; // scale by master volume
-        samples[i] = high_pass(samples[i], i);
-        write_to_buf(samples[i]);
+        levels[i] *= (float)(((*(ram+REG_NR50) >> (4*i)) & 7) + 1) / 8.0; // scale by master volume
+    }
+}
 
+
+static inline void queue_sample(float* samples) {
+    /* apply the high-pass filter to a finished sample and queue it into the buffer to be
+    copied by the miniaudio callback, time stretching it first when running fast */
+    for (uint8_t i=0; i<DEVICE_CHANNELS; i++) samples[i] = high_pass(samples[i], i);
+    if (emulation_speed > 1.0 || stretching) {
+        stretch_sample(samples);
+    } else {
+        for (uint8_t i=0; i<DEVICE_CHANNELS; i++) write_to_buf(samples[i]);
     }
     frames_written++;
 }
 
 
+static inline uint64_t blip_position_at(uint64_t cycle) {
+    /* the output position of a cycle at or after blip_cycle */
+    return blip_position + (cycle - blip_cycle) * blip_step;
+}
+
+
+static void add_level_change(uint64_t cycle) {
+    /* if the mixed level has changed, add a band-limited step of the difference at the exact
+    output position of the cycle it changed in */
+    float levels[DEVICE_CHANNELS];
+    mix_levels(levels);
+    uint64_t position = blip_position_at(cycle);
+    float (*deltas)[DEVICE_CHANNELS] = &blip_deltas[position >> BLIP_FRAC_BITS];
+    float* kernel = blip_kernel[(position >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    for (uint8_t i=0; i<DEVICE_CHANNELS; i++) {
+        float delta = levels[i] - blip_levels[i];
+        if (delta == 0) continue;
+        blip_levels[i] = levels[i];
+        for (uint8_t j=0; j<BLIP_TAPS; j++) deltas[j][i] += delta * kernel[j];
+    }
+}
+
+
+static void read_blip(uint64_t cycle) {
+    /* output every sample before the given cycle, which no later level change can reach,
+    by adding up the deltas in one pass. The rest are moved to the start of the buffer */
+    uint64_t position = blip_position_at(cycle);
+    uint32_t finished = position >> BLIP_FRAC_BITS;
+    for (uint32_t i=0; i<finished; i++) {
+        float samples[DEVICE_CHANNELS];
+        for (uint8_t j=0; j<DEVICE_CHANNELS; j++) {
+            blip_sums[j] += blip_deltas[i][j];
+            samples[j] = blip_sums[j];
+        }
+        queue_sample(samples);
+    }
+    memmove(blip_deltas, blip_deltas[finished], sizeof(blip_deltas[0]) * BLIP_TAPS);
+    memset(blip_deltas[BLIP_TAPS], 0, sizeof(blip_deltas[0]) * finished);
+    blip_position = position - ((uint64_t)finished << BLIP_FRAC_BITS);
+    blip_cycle = cycle;
+}
+
+
+static void wait_for_audio_device(void) {
+    /* with audio sync, hold emulation back while the device has enough audio left to play.
+    The device consumes samples at exactly its sample rate, so this paces emulation to it */
+    if (hyperspeed) return;
+    while (get_buffered_frames() > AUDIO_SYNC_MAX_FRAMES) {
+        struct timespec waittime = {0, AUDIO_SYNC_WAIT_NS};
+        nanosleep(&waittime, &waittime);
+    }
+}
+
+
 static void enable_channel(uint8_t channel_id) {
     /* start a pulse or noise channel */
     if (*(ram+REG_NRx4[channel_id])&0x80) { // require trigger bit is set
         *(ram+REG_NRx4[channel_id]) &= 0x7f; // reset trigger bit
         if (channel_id == 2) { // wave channel attributes
-            if (!(read_byte(REG_NR30) & 128)) return; // only proceed if DAC is on
+            if (!(*(ram+REG_NR30) & 128)) return; // only proceed if DAC is on
             if (channels[2].length_timer >= 256) channels[2].length_timer = *(ram + REG_NR31); // reset length timer if expired
             channels[2].amplitude = (*(ram + REG_NR32)>>5)&3;
         } else { // other channel attributes
-            if (!(read_byte(REG_NRx2[channel_id]) & 0xF8)) return; // only proceed if DAC is on
+            if (!(*(ram+REG_NRx2[channel_id]) & 0xF8)) return; // only proceed if DAC is on
             if (channels[channel_id].length_timer >= 64) channels[channel_id].length_timer = *(ram + REG_NRx1[channel_id])&63; // reset length timer if expired
-            channels[channel_id].amplitude = read_byte(REG_NRx2[channel_id]) >> 4; // set sweep amplitude
+            channels[channel_id].amplitude = *(ram+REG_NRx2[channel_id]) >> 4; // set sweep amplitude
             channels[channel_id].amp_sweep_timer = 0; // reset amplitude envelope timer
-            channels[channel_id].amp_sweep_attrs = read_byte(REG_NRx2[channel_id]) & 15; // store amplitude sweep pace and direction
+            channels[channel_id].amp_sweep_attrs = *(ram+REG_NRx2[channel_id]) & 15; // store amplitude sweep pace and direction
         }
         // common attributes
         *(ram+REG_NR52) |= (1<<channel_id); // enable channel
@@ -360,7 +576,7 @@ void handle_audio_register(uint16_t addr) {
     {
     case REG_NR14: // channel 1
         enable_channel(0);
-        ch1_freq_sweep_timer = (read_byte(REG_NR10)>>4)&7;
+        ch1_freq_sweep_timer = (*(ram+REG_NR10)>>4)&7;
         break;
     case REG_NR24: // channel 2
         enable_channel(1);
@@ -385,14 +601,39 @@ void handle_audio_register(uint16_t addr) {
 }
 
 
+static inline uint16_t period_register(uint8_t channel_id) {
+    /* the period a pulse or wave channel's period counter is reset to when it overflows */
+    return *(ram+REG_NRx3[channel_id]) + (((uint16_t)(*(ram+REG_NRx4[channel_id])&7))<<8);
+}
+
+
+static inline uint8_t wave_sample(uint8_t wave_ram_index) {
+    /* read the sample at the given index of wave RAM */
+    return (*(ram+REG_WAVE1 + wave_ram_index/2) >> (4*(wave_ram_index+1)%2))&0xF;
+}
+
+
+static inline void step_lfsr(void) {
+    /* advance the LFSR of channel 4 (noise) */
+    bool next_bit = (ch4_LFSR&1) == ((ch4_LFSR>>1)&1);
+    ch4_LFSR &= ~(1<<15);
+    ch4_LFSR |= next_bit<<15;
+    if (*(ram+REG_NR43)&8) { // LFSR short mode
+        ch4_LFSR &= ~(1<<7);
+        ch4_LFSR |= next_bit<<7;
+    }
+    ch4_LFSR >>= 1;
+}
+
+
 static inline void tick_pulse_channel(bool channel_id) {
     /* process the ticking of channel 1 or 2 (pulse). This function is called at a rate of 1MHz */
-    if (read_byte(REG_NR52) & (1<<channel_id)) { // is channel on?
+    if (*(ram+REG_NR52) & (1<<channel_id)) { // is channel on?
         channels[channel_id].pulse_period++;
         if (channels[channel_id].pulse_period >= 0x7FF) { // overflow at 2047
-            channels[channel_id].pulse_period = *(ram+REG_NRx3[channel_id]) + (((uint16_t)(*(ram+REG_NRx4[channel_id])&7))<<8); // reset to the channel period
+            channels[channel_id].pulse_period = period_register(channel_id); // reset to the channel period
 
-            uint8_t duty_limit = (read_byte(REG_NRx1[channel_id])>>6) * 2;
+            uint8_t duty_limit = (*(ram+REG_NRx1[channel_id])>>6) * 2;
             if (!duty_limit) duty_limit++;
             if ((channels[channel_id].duty_period&7) < duty_limit) { // sample is low
                 channels[channel_id].sample_state = 0;
@@ -407,13 +648,13 @@ static inline void tick_pulse_channel(bool channel_id) {
 
 static inline void tick_wave_channel(void) {
     /* process the ticking of channel 3 (wave) This function is called at a rate of 2MHz */
-    if (read_byte(REG_NR52) & 4) { // is channel on?
+    if (*(ram+REG_NR52) & 4) { // is channel on?
         channels[2].pulse_period++;
         if (channels[2].pulse_period >= 0x7FF) { // overflow at 2047
-            channels[2].pulse_period = *(ram+REG_NR33) + (((uint16_t)(*(ram+REG_NR34)&7))<<8); // reset to the channel period
+            channels[2].pulse_period = period_register(2); // reset to the channel period
             ch3_wave_ram_index++;
             if (ch3_wave_ram_index == 32) ch3_wave_ram_index = 0;
-            ch3_buffered_sample = (read_byte(REG_WAVE1 + ch3_wave_ram_index/2) >> (4*(ch3_wave_ram_index+1)%2))&0xF;
+            ch3_buffered_sample = wave_sample(ch3_wave_ram_index);
         }
         if (channels[2].amplitude) {
             channels[2].sample_state = ch3_buffered_sample >> (channels[2].amplitude - 1);
@@ -424,53 +665,270 @@ static inline void tick_wave_channel(void) {
 }
 
 
+static inline uint32_t noise_tick_timeout(void) {
+    /* number of ticks of channel 4 between each step of its LFSR */
+    uint32_t tick_timeout = 2 * (*(ram+REG_NR43)&7);
+    if (!tick_timeout) tick_timeout = 1; // treat the divider as 0.5 if the register is set to 0
+    return tick_timeout << ((*(ram+REG_NR43)>>4)+1);
+}
+
+
 static inline void tick_noise_channel(void) {
     /* process the ticking of channel 4 (noise). This function is called at a rate of 1MHz */
-    if (read_byte(REG_NR52) & 8) { // is channel on?
-        uint32_t tick_timeout = 2 * (read_byte(REG_NR43)&7);
-        if (!tick_timeout) tick_timeout = 1; // treat the divider as 0.5 if the register is set to 0
-        tick_timeout <<= (read_byte(REG_NR43)>>4)+1;
+    if (*(ram+REG_NR52) & 8) { // is channel on?
         ch4_LFSR_timer++;
-        if (ch4_LFSR_timer >= tick_timeout) { // advance the LFSR
+        if (ch4_LFSR_timer >= noise_tick_timeout()) { // advance the LFSR
             ch4_LFSR_timer = 0;
-            bool next_bit = (ch4_LFSR&1) == ((ch4_LFSR>>1)&1);
-            ch4_LFSR &= ~(1<<15);
-            ch4_LFSR |= next_bit<<15;
-            if (read_byte(REG_NR43)&8) { // LFSR short mode
-                ch4_LFSR &= ~(1<<7);
-                ch4_LFSR |= next_bit<<7;
-            }
-            ch4_LFSR >>= 1;
+            step_lfsr();
         }
         channels[3].sample_state = channels[3].amplitude * (ch4_LFSR&1);
     }
 }
 
 
-void tick_audio(void) {
-    /* tick every t-cycle and handle timing of all audio events */
-    bool div_bit = (system_counter>>12)&1; // bit 4 of div
+static inline void tick_apu(uint16_t counter) {
+    /* run the APU for one t-cycle, given the value system_counter had in that cycle */
+    bool div_bit = (counter>>12)&1; // bit 4 of div
     if (last_div_bit && !div_bit) {
 
         if (div_apu % 2 == 0) event_length();           // 256 Hz
         if (div_apu % 4 == 3) event_ch1_freq_sweep();   // 128 Hz
         if (div_apu % 8 == 7) event_envelope_sweep();   // 64 Hz
         div_apu++;
+        noise_refresh = 1; // the envelope may have changed its amplitude
     }
-    if (system_counter % 2 == 0) tick_wave_channel();
-    if (system_counter % 4 == 0) {
+    if (counter % 2 == 0) {
+        tick_wave_channel();
+        wave_refresh = 0;
+    }
+    if (counter % 4 == 0) {
         tick_pulse_channel(0);
         tick_pulse_channel(1);
         tick_noise_channel();
+        noise_refresh = 0;
     }
 
-    if (do_export_wav && !(system_counter % (CLK_HZ / WAV_SAMPLE_RATE))) wav_write_sample();
+    if (do_export_wav && !audio_muted && !(counter % (CLK_HZ / WAV_SAMPLE_RATE))) wav_write_sample();
 
-    gb_sample_index++;
-    if (gb_sample_index >= audio_sample_divider) { // send samples every 4MHz / 48000Hz samples
-        queue_sample();
-        gb_sample_index = 0;
+    last_div_bit = div_bit;
+}
+
+
+static inline uint16_t counter_at(uint64_t cycle) {
+    /* the value system_counter had in the given cycle. system_counter only steps by one each cycle
+    between catch ups, as writing to DIV catches up first, so it can be worked back from now.
+    A DIV write sets it to 0 for the rest of that cycle alone, which the per-cycle APU also ticked
+    once, so no cycle is repeated or lost */
+    return system_counter - (uint16_t)(cycles_run - cycle);
+}
+
+
+static inline uint64_t nth_tick(uint64_t cycle, uint32_t interval, uint32_t n) {
+    /* the cycle of the nth tick after the given cycle, of a clock that ticks whenever the
+    counter is a multiple of interval */
+    return cycle + interval - (counter_at(cycle) % interval) + (uint64_t)(n - 1) * interval;
+}
+
+
+static inline uint32_t ticks_between(uint64_t from, uint64_t to, uint32_t interval) {
+    /* the number of ticks of a clock with the given interval in the cycles after from, up to to */
+    uint64_t start = counter_at(from);
+    return (start + (to - from)) / interval - start / interval;
+}
+
+
+static inline uint32_t ticks_to_overflow(uint16_t pulse_period) {
+    /* the number of ticks until a pulse or wave channel's period counter overflows */
+    return pulse_period >= 0x7FF ? 1 : 0x7FF - pulse_period;
+}
+
+
+static inline uint32_t count_period(uint16_t* pulse_period, uint16_t reset_period, uint32_t ticks) {
+    /* count a pulse or wave channel's period counter on by the given number of ticks,
+    returning the number of times it overflowed */
+    uint32_t first = ticks_to_overflow(*pulse_period);
+    if (ticks < first) {
+        *pulse_period += ticks;
+        return 0;
     }
+    ticks -= first;
+    uint32_t interval = ticks_to_overflow(reset_period); // ticks between each overflow after the first
+    *pulse_period = reset_period + ticks % interval;
+    return 1 + ticks / interval;
+}
 
-    last_div_bit = div_bit;
-}
\ No newline at end of file
+
+static inline bool pulse_silent(uint8_t channel_id) {
+    /* whether a pulse channel's steps leave its sample at 0 */
+    return !channels[channel_id].amplitude && !channels[channel_id].sample_state;
+}
+
+
+static inline bool wave_silent(void) {
+    /* whether channel 3's steps leave its sample at 0 */
+    return !channels[2].amplitude && !wave_refresh;
+}
+
+
+static inline bool noise_silent(void) {
+    /* whether channel 4's steps leave its sample at 0 */
+    return !channels[3].amplitude && !noise_refresh;
+}
+
+
+static uint64_t next_apu_event(void) {
+    /* the first cycle after apu_cycles in which a tick does more than count a channel towards its
+    next step: the frame sequencer, a step of any channel that is on and not silent, or a sample of
+    the wav file. Silent channels are left to skip_apu, as their steps do not change the output */
+    uint64_t next;
+    if (last_div_bit && !((counter_at(apu_cycles + 1)>>12)&1)) { // falling edge of bit 4 of div
+        next = apu_cycles + 1;
+    } else {
+        next = nth_tick(apu_cycles + 1, 1<<13, 1);
+    }
+    uint64_t event;
+    if (do_export_wav && !audio_muted) {
+        event = nth_tick(apu_cycles, CLK_HZ / WAV_SAMPLE_RATE, 1);
+        if (event < next) next = event;
+    }
+    for (uint8_t i=0; i<2; i++) {
+        if ((*(ram+REG_NR52) & (1<<i)) && !pulse_silent(i)) {
+            event = nth_tick(apu_cycles, 4, ticks_to_overflow(channels[i].pulse_period));
+            if (event < next) next = event;
+        }
+    }
+    if ((*(ram+REG_NR52) & 4) && !wave_silent()) {
+        event = nth_tick(apu_cycles, 2, wave_refresh ? 1 : ticks_to_overflow(channels[2].pulse_period));
+        if (event < next) next = event;
+    }
+    if ((*(ram+REG_NR52) & 8) && !noise_silent()) {
+        uint32_t tick_timeout = noise_tick_timeout();
+        uint32_t ticks = (noise_refresh || ch4_LFSR_timer >= tick_timeout) ? 1 : tick_timeout - ch4_LFSR_timer;
+        event = nth_tick(apu_cycles, 4, ticks);
+        if (event < next) next = event;
+    }
+    return next;
+}
+
+
+static inline void skip_apu(uint64_t cycle) {
+    /* run the APU up to the given cycle, when no tick before it does more than count the channels
+    towards their next step or step a silent channel, by counting all of them at once */
+    if (cycle <= apu_cycles) return;
+    for (uint8_t i=0; i<2; i++) {
+        if (*(ram+REG_NR52) & (1<<i)) {
+            channels[i].duty_period += count_period(&channels[i].pulse_period, period_register(i), ticks_between(apu_cycles, cycle, 4));
+        }
+    }
+    if (*(ram+REG_NR52) & 4) {
+        uint32_t steps = count_period(&channels[2].pulse_period, period_register(2), ticks_between(apu_cycles, cycle, 2));
+        if (steps) {
+            ch3_wave_ram_index = (ch3_wave_ram_index + steps) % 32;
+            ch3_buffered_sample = wave_sample(ch3_wave_ram_index);
+        }
+    }
+    if (*(ram+REG_NR52) & 8) {
+        uint32_t ticks = ticks_between(apu_cycles, cycle, 4);
+        uint32_t tick_timeout = noise_tick_timeout();
+        uint32_t first = ch4_LFSR_timer >= tick_timeout ? 1 : tick_timeout - ch4_LFSR_timer;
+        if (ticks < first) {
+            ch4_LFSR_timer += ticks;
+        } else {
+            for (uint32_t steps = 1 + (ticks - first) / tick_timeout; steps; steps--) step_lfsr();
+            ch4_LFSR_timer = (ticks - first) % tick_timeout;
+        }
+    }
+    last_div_bit = (counter_at(cycle)>>12)&1;
+    apu_cycles = cycle;
+}
+
+
+static void run_apu(uint64_t cycle) {
+    /* run the APU until it has caught up with the given cycle. Nothing but the APU changes its state,
+    and it only reads registers that cause a catch up before they are written, so running it late
+    gives the same result. Only the cycles where something happens are ticked, and the output level
+    changes in those are added to the band-limited step buffer at their exact position */
+    if (cycle <= apu_cycles) return;
+    if (stop_mode) { // the APU does not run in STOP mode
+        apu_cycles = cycle;
+        blip_cycle = cycle;
+        return;
+    }
+    bool output = !audio_muted;
+    if (output) {
+        if (audio_sync) { // samples at exactly 48000Hz of emulated time, which the device sets the pace of
+            blip_step = ((uint64_t)DEVICE_SAMPLE_RATE << BLIP_FRAC_BITS) / CLK_HZ;
+        } else { // samples every audio_sample_divider cycles, nudged to keep the buffer level
+            blip_step = ((uint64_t)1 << BLIP_FRAC_BITS) / audio_sample_divider;
+        }
+        add_level_change(apu_cycles + 1); // registers written since the last catch up
+    }
+    wave_refresh = noise_refresh = 1; // their amplitude may have been written
+
+    while (apu_cycles < cycle) {
+        uint64_t next = next_apu_event();
+        if (next > apu_cycles + APU_MAX_STEP) next = apu_cycles + APU_MAX_STEP; // keep the buffer from filling
+        if (next > cycle) {
+            skip_apu(cycle);
+            break;
+        }
+        skip_apu(next - 1);
+        apu_cycles = next;
+        tick_apu(counter_at(next));
+        if (output) {
+            add_level_change(next);
+            if ((blip_position_at(next) >> BLIP_FRAC_BITS) >= BLIP_FLUSH_FRAMES) read_blip(next);
+        }
+    }
+
+    if (output) {
+        read_blip(cycle);
+    } else {
+        blip_cycle = cycle;
+    }
+}
+
+
+void prepare_audio_access(void) {
+    /* called before the CPU reads or writes an audio register or DIV. Cycles before the
+    current one are run first, so the APU sees the access at the same time as the CPU */
+    if (no_audio) return;
+    run_apu(cycles_run - 1);
+}
+
+
+void catch_up_audio(void) {
+    /* run the APU for every cycle so far, making all of their samples at once. Called at the
+    end of every frame, and before entering or leaving STOP mode */
+    run_apu(cycles_run);
+    if (audio_sync && !audio_muted) wait_for_audio_device();
+}
+
+
+void save_apu_state(ApuState *state) {
+    /* copy the state of each channel and the frame sequencer into state. The APU must be caught up */
+    memcpy(state->channels, channels, sizeof(channels));
+    state->div_apu = div_apu;
+    state->last_div_bit = last_div_bit;
+    state->ch1_freq_sweep_timer = ch1_freq_sweep_timer;
+    state->ch3_buffered_sample = ch3_buffered_sample;
+    state->ch3_wave_ram_index = ch3_wave_ram_index;
+    state->ch4_LFSR = ch4_LFSR;
+    state->ch4_LFSR_timer = ch4_LFSR_timer;
+    state->apu_cycles = apu_cycles;
+}
+
+
+void load_apu_state(const ApuState *state) {
+    /* restore the APU state saved by save_apu_state. Output to the device carries on from where it was */
+    memcpy(channels, state->channels, sizeof(channels));
+    div_apu = state->div_apu;
+    last_div_bit = state->last_div_bit;
+    ch1_freq_sweep_timer = state->ch1_freq_sweep_timer;
+    ch3_buffered_sample = state->ch3_buffered_sample;
+    ch3_wave_ram_index = state->ch3_wave_ram_index;
+    ch4_LFSR = state->ch4_LFSR;
+    ch4_LFSR_timer = state->ch4_LFSR_timer;
+    apu_cycles = state->apu_cycles;
+    blip_cycle = apu_cycles;
+}
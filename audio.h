@@ -21,10 +21,25 @@ typedef struct channel_attributes {
 
 }channel_attributes;
 
+typedef struct {
+    channel_attributes channels[4];
+    uint8_t div_apu;
+    bool last_div_bit;
+    uint8_t ch1_freq_sweep_timer;
+    uint8_t ch3_buffered_sample;
+    uint8_t ch3_wave_ram_index;
+    uint16_t ch4_LFSR;
+    uint32_t ch4_LFSR_timer;
+    uint64_t apu_cycles;
+} ApuState;
+
 void data_callback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount);
 void init_audio(void);
 void close_audio(void);
 void handle_audio_register(uint16_t addr);
-void tick_audio(void);
+void prepare_audio_access(void);
+void catch_up_audio(void);
+void save_apu_state(ApuState *state);
+void load_apu_state(const ApuState *state);
 
 #endif //AUDIO
\ No newline at end of file
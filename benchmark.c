@@ -0,0 +1,297 @@
+/* Microbenchmarks for the performance critical kernels of gbemu.
+    Build with `make benchmark` and run `./benchmark`.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <string.h>
+#include "tile_decode.h"
+#include "colour_convert.h"
+#include "scanline.h"
+#include "upscale.h"
+
+#define DECODE_ROWS 100000000UL
+#define CONVERT_FRAMES 20000UL
+#define FRAME_PIXELS (160*144)
+#define MAP_LINES 20000000UL
+#define UPSCALE_FRAMES 2000UL
+
+
+static double seconds_since(struct timespec *start) {
+    /* get the wall time elapsed since start */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static void bench_tile_decoder(const char *name, TileRowDecoder decoder) {
+    /* check a tile row decoder against the portable one, then measure its throughput */
+    for (int i=0; i<0x10000; i++) {
+        if (decoder(i&0xFF, i>>8) != decode_tile_row_portable(i&0xFF, i>>8)) {
+            printf("%-10s MISMATCH at low=0x%.2X high=0x%.2X\n", name, i&0xFF, i>>8);
+            return;
+        }
+    }
+
+    struct timespec start;
+    uint64_t checksum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<DECODE_ROWS; i++) {
+        checksum += decoder(i, i>>8); // sum results so the calls can't be discarded
+    }
+    double elapsed = seconds_since(&start);
+    printf("%-10s %8.1f Mrows/s  (checksum %.16lx)\n", name, DECODE_ROWS / elapsed / 1e6, checksum);
+}
+
+
+static void bench_colour_converter(const char *name, ShadeRowConverter converter) {
+    /* check a shade converter against the portable one, then measure its throughput over whole frames */
+    static uint8_t shades[FRAME_PIXELS];
+    static uint8_t rgb[FRAME_PIXELS*3], expected[FRAME_PIXELS*3];
+    uint8_t tables[3][16];
+    for (int i=0; i<16; i++) {
+        tables[0][i] = i*16; tables[1][i] = 255-i; tables[2][i] = i*7;
+    }
+    for (int i=0; i<FRAME_PIXELS; i++) shades[i] = (i*7 + i/160) % 6;
+
+    convert_shade_row_portable(shades, expected, tables, FRAME_PIXELS);
+    converter(shades, rgb, tables, FRAME_PIXELS);
+    if (memcmp(rgb, expected, sizeof(rgb))) {
+        printf("%-10s MISMATCH\n", name);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<CONVERT_FRAMES; i++) {
+        for (int y=0; y<144; y++) converter(shades+160*y, rgb+480*y, tables, 160);
+        shades[i%FRAME_PIXELS] = i&3; // keep the loop from being hoisted
+    }
+    double elapsed = seconds_since(&start);
+    printf("%-10s %8.1f Mpixels/s %9.0f frames/s\n", name, CONVERT_FRAMES*FRAME_PIXELS / elapsed / 1e6, CONVERT_FRAMES / elapsed);
+}
+
+
+static void bench_bgw_mapper(const char *name, BgwRowMapper mapper) {
+    /* check a background/window line mapper against the portable one, then measure its throughput */
+    uint8_t ids[160], under[160], shades[160], opaque[160], expected_shades[160], expected_opaque[160];
+    const uint8_t palette[4] = {3, 0, 2, 1};
+    for (int i=0; i<160; i++) {
+        ids[i] = (i*5/3)&3;
+        under[i] = (i/7)&3;
+    }
+    map_bgw_row_portable(ids, under, palette, expected_shades, expected_opaque, 160);
+    mapper(ids, under, palette, shades, opaque, 160);
+    if (memcmp(shades, expected_shades, 160) || memcmp(opaque, expected_opaque, 160)) {
+        printf("%-10s MISMATCH\n", name);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<MAP_LINES; i++) {
+        mapper(ids, under, palette, shades, opaque, 160);
+        ids[i%160] = shades[(i*3)%160]; // feed results back so the loop can't be hoisted
+    }
+    double elapsed = seconds_since(&start);
+    printf("%-10s %8.1f Mlines/s\n", name, MAP_LINES / elapsed / 1e6);
+}
+
+
+static void bench_object_blender(const char *name, ObjectRowBlender blender) {
+    /* check a sprite line blender against the portable one, then measure its throughput */
+    uint8_t objects[160], mask[160], shades[160], expected[160];
+    for (int i=0; i<160; i++) {
+        objects[i] = i&3;
+        mask[i] = (i%11 < 4) ? 0xFF : 0;
+        shades[i] = expected[i] = (i/3)&3;
+    }
+    blend_object_row_portable(objects, mask, expected, 160);
+    blender(objects, mask, shades, 160);
+    if (memcmp(shades, expected, 160)) {
+        printf("%-10s MISMATCH\n", name);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<MAP_LINES; i++) {
+        blender(objects, mask, shades, 160);
+        objects[i%160] = shades[(i*3)%160] + 1; // feed results back so the loop can't be hoisted
+    }
+    double elapsed = seconds_since(&start);
+    printf("%-10s %8.1f Mlines/s\n", name, MAP_LINES / elapsed / 1e6);
+}
+
+
+static void test_frame(uint8_t shades[FRAME_PIXELS]) {
+    /* fill a frame with shapes that give the upscalers edges and diagonals to work on */
+    for (int y=0; y<144; y++) {
+        for (int x=0; x<160; x++) {
+            shades[y*160+x] = ((x+y)/5 + (x*x+y)/97 + (x > y)) & 3;
+        }
+    }
+}
+
+
+static void report_upscaler(const char *name, int factor, double elapsed) {
+    /* print the output rate of an upscaler */
+    printf("%-10s %8.1f Mpixels/s %9.0f frames/s\n", name, UPSCALE_FRAMES*FRAME_PIXELS*factor*factor / elapsed / 1e6, UPSCALE_FRAMES / elapsed);
+}
+
+
+static void bench_scale2x(const char *name, Scale2xRow kernel) {
+    /* check a scale2x kernel against the portable one, then measure its output rate over whole frames */
+    static uint8_t shades[FRAME_PIXELS], out[FRAME_PIXELS*4], expected[FRAME_PIXELS*4];
+    test_frame(shades);
+    scale2x_row = scale2x_row_portable;
+    scale2x_frame(shades, 160, 144, expected);
+    scale2x_row = kernel;
+    scale2x_frame(shades, 160, 144, out);
+    if (memcmp(out, expected, sizeof(out))) {
+        printf("%-10s MISMATCH\n", name);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<UPSCALE_FRAMES; i++) {
+        scale2x_frame(shades, 160, 144, out);
+        shades[i%FRAME_PIXELS] = out[(i*7)%sizeof(out)]; // feed results back so the loop can't be hoisted
+    }
+    report_upscaler(name, 2, seconds_since(&start));
+}
+
+
+static void bench_scale3x(const char *name, Scale3xRow kernel) {
+    /* check a scale3x kernel against the portable one, then measure its output rate over whole frames */
+    static uint8_t shades[FRAME_PIXELS], out[FRAME_PIXELS*9], expected[FRAME_PIXELS*9];
+    test_frame(shades);
+    scale3x_row = scale3x_row_portable;
+    scale3x_frame(shades, 160, 144, expected);
+    scale3x_row = kernel;
+    scale3x_frame(shades, 160, 144, out);
+    if (memcmp(out, expected, sizeof(out))) {
+        printf("%-10s MISMATCH\n", name);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<UPSCALE_FRAMES; i++) {
+        scale3x_frame(shades, 160, 144, out);
+        shades[i%FRAME_PIXELS] = out[(i*7)%sizeof(out)];
+    }
+    report_upscaler(name, 3, seconds_since(&start));
+}
+
+
+static bool check_xbr2x(const uint8_t tables[3][16]) {
+    /* check the xBR style filter against frames whose output is known. Vertical stripes have no
+    diagonal edges, so every pixel is only doubled. A 45 degree staircase blends the one corner
+    of each pixel on either side of the diagonal that faces it, half way to the other colour */
+    static uint8_t shades[FRAME_PIXELS], rgb[FRAME_PIXELS*4*3], expected[FRAME_PIXELS*4*3];
+    for (int frame=0; frame<2; frame++) {
+        for (int y=0; y<144; y++) {
+            for (int x=0; x<160; x++) shades[y*160+x] = frame ? (x > y)*3 : (x/8)&3;
+        }
+        for (int y=0; y<288; y++) {
+            for (int x=0; x<320; x++) {
+                int px = x/2, py = y/2;
+                uint8_t shade = shades[py*160+px];
+                bool blended = frame && ((px == py+1 && !(x&1) && (y&1) && py < 143) || (px == py && (x&1) && !(y&1) && py > 0 && px < 159));
+                for (int channel=0; channel<3; channel++) {
+                    uint8_t value = tables[channel][shade];
+                    if (blended) value = (tables[channel][0] + tables[channel][3] + 1) / 2;
+                    expected[(y*320+x)*3+channel] = value;
+                }
+            }
+        }
+        xbr2x_frame(shades, 160, 144, tables, rgb);
+        if (memcmp(rgb, expected, sizeof(rgb))) return 0;
+    }
+    return 1;
+}
+
+
+static void bench_xbr2x(void) {
+    /* check the xBR style filter's output, then measure its output rate. It writes RGB */
+    static uint8_t shades[FRAME_PIXELS], rgb[FRAME_PIXELS*4*3];
+    uint8_t tables[3][16] = {{0xF8,0xA0,0x50,0x00,0xFF,0xFF}, {0xF8,0xA0,0x50,0x00,0xFF,0x00}, {0xF8,0xA0,0x50,0x00,0xFF,0x00}};
+    if (!check_xbr2x((const uint8_t (*)[16])tables)) {
+        printf("%-10s MISMATCH\n", "xbr2x");
+        return;
+    }
+    test_frame(shades);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint64_t i=0; i<UPSCALE_FRAMES; i++) {
+        xbr2x_frame(shades, 160, 144, tables, rgb);
+        shades[i%FRAME_PIXELS] = rgb[(i*7)%sizeof(rgb)] & 3;
+    }
+    report_upscaler("xbr2x", 2, seconds_since(&start));
+}
+
+
+int main(void) {
+    init_tile_decode();
+    printf("Tile row decoders (selected: %s)\n", tile_decode_kernel_name());
+    bench_tile_decoder("portable", decode_tile_row_portable);
+    bench_tile_decoder("lut", decode_tile_row_lut);
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        bench_tile_decoder("bmi2", decode_tile_row_bmi2);
+    } else {
+        printf("%-10s not supported by this cpu\n", "bmi2");
+    }
+#endif
+
+    init_colour_convert();
+    printf("\nShade to RGB converters (selected: %s)\n", colour_convert_kernel_name());
+    bench_colour_converter("portable", convert_shade_row_portable);
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("ssse3")) bench_colour_converter("ssse3", convert_shade_row_ssse3);
+    if (__builtin_cpu_supports("avx2")) bench_colour_converter("avx2", convert_shade_row_avx2);
+#endif
+
+    init_scanline();
+    printf("\nBackground/window line mappers (selected: %s)\n", scanline_kernel_name());
+    bench_bgw_mapper("portable", map_bgw_row_portable);
+#ifdef __x86_64__
+    bench_bgw_mapper("sse2", map_bgw_row_sse2);
+    if (__builtin_cpu_supports("avx2")) bench_bgw_mapper("avx2", map_bgw_row_avx2);
+#endif
+
+    printf("\nSprite line blenders (selected: %s)\n", scanline_kernel_name());
+    bench_object_blender("portable", blend_object_row_portable);
+#ifdef __x86_64__
+    bench_object_blender("sse2", blend_object_row_sse2);
+    if (__builtin_cpu_supports("avx2")) bench_object_blender("avx2", blend_object_row_avx2);
+#endif
+
+    init_upscale();
+    printf("\nScale2x upscalers (selected: %s)\n", upscale_kernel_name());
+    bench_scale2x("portable", scale2x_row_portable);
+#ifdef __x86_64__
+    bench_scale2x("sse2", scale2x_row_sse2);
+    if (__builtin_cpu_supports("avx2")) bench_scale2x("avx2", scale2x_row_avx2);
+#endif
+
+    printf("\nScale3x upscalers\n");
+    bench_scale3x("portable", scale3x_row_portable);
+#ifdef __x86_64__
+    bench_scale3x("sse2", scale3x_row_sse2);
+#endif
+
+    printf("\nOther upscalers\n");
+    bench_xbr2x();
+    return 0;
+}
@@ -0,0 +1,132 @@
+/* Source file for colour_convert.c, expanding shade indices into RGB texels.
+    Each shade is a byte in [0, 15] that selects one entry from three 16-entry
+    tables, one per colour channel. The SIMD kernels look up 16 or 32 shades at
+    once with pshufb and then shuffle the three channel vectors into packed RGB.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "colour_convert.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static const char* kernel_name = "portable";
+
+ShadeRowConverter convert_shade_row = convert_shade_row_portable; //extern
+
+
+void convert_shade_row_portable(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count) {
+    /* convert a row of shades one texel at a time */
+    for (int i=0; i<count; i++) {
+        rgb[3*i]   = tables[0][shades[i]&15];
+        rgb[3*i+1] = tables[1][shades[i]&15];
+        rgb[3*i+2] = tables[2][shades[i]&15];
+    }
+}
+
+
+#ifdef __x86_64__
+#define Z 0x80 // pshufb writes zero for any index with the top bit set
+
+// for each 16-byte block of RGB output, which channel vector byte lands at each position
+static const uint8_t rgb_gather[3][3][16] = {
+    { // red channel
+        {0,Z,Z,1,Z,Z,2,Z,Z,3,Z,Z,4,Z,Z,5},
+        {Z,Z,6,Z,Z,7,Z,Z,8,Z,Z,9,Z,Z,10,Z},
+        {Z,11,Z,Z,12,Z,Z,13,Z,Z,14,Z,Z,15,Z,Z}
+    },
+    { // green channel
+        {Z,0,Z,Z,1,Z,Z,2,Z,Z,3,Z,Z,4,Z,Z},
+        {5,Z,Z,6,Z,Z,7,Z,Z,8,Z,Z,9,Z,Z,10},
+        {Z,Z,11,Z,Z,12,Z,Z,13,Z,Z,14,Z,Z,15,Z}
+    },
+    { // blue channel
+        {Z,Z,0,Z,Z,1,Z,Z,2,Z,Z,3,Z,Z,4,Z},
+        {Z,5,Z,Z,6,Z,Z,7,Z,Z,8,Z,Z,9,Z,Z},
+        {10,Z,Z,11,Z,Z,12,Z,Z,13,Z,Z,14,Z,Z,15}
+    }
+};
+#undef Z
+
+
+__attribute__((target("ssse3")))
+void convert_shade_row_ssse3(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count) {
+    /* convert a row of shades 16 texels at a time */
+    const __m128i low_nibble = _mm_set1_epi8(15);
+    __m128i lut[3], gather[3][3];
+    for (int c=0; c<3; c++) {
+        lut[c] = _mm_loadu_si128((const __m128i*)tables[c]);
+        for (int k=0; k<3; k++) gather[c][k] = _mm_loadu_si128((const __m128i*)rgb_gather[c][k]);
+    }
+    int i = 0;
+    for (; i+16<=count; i+=16) {
+        __m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i*)(shades+i)), low_nibble);
+        __m128i channel[3];
+        for (int c=0; c<3; c++) channel[c] = _mm_shuffle_epi8(lut[c], index);
+        for (int k=0; k<3; k++) {
+            __m128i block = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(channel[0], gather[0][k]), _mm_shuffle_epi8(channel[1], gather[1][k])),
+                _mm_shuffle_epi8(channel[2], gather[2][k])
+            );
+            _mm_storeu_si128((__m128i*)(rgb+3*i+16*k), block);
+        }
+    }
+    convert_shade_row_portable(shades+i, rgb+3*i, tables, count-i);
+}
+
+
+__attribute__((target("avx2")))
+void convert_shade_row_avx2(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count) {
+    /* convert a row of shades 32 texels at a time. pshufb works within each 128-bit lane,
+    so each lane produces 48 bytes of RGB which are recombined before storing */
+    const __m256i low_nibble = _mm256_set1_epi8(15);
+    __m256i lut[3], gather[3][3];
+    for (int c=0; c<3; c++) {
+        lut[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)tables[c]));
+        for (int k=0; k<3; k++) gather[c][k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)rgb_gather[c][k]));
+    }
+    int i = 0;
+    for (; i+32<=count; i+=32) {
+        __m256i index = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(shades+i)), low_nibble);
+        __m256i channel[3], block[3];
+        for (int c=0; c<3; c++) channel[c] = _mm256_shuffle_epi8(lut[c], index);
+        for (int k=0; k<3; k++) {
+            block[k] = _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(channel[0], gather[0][k]), _mm256_shuffle_epi8(channel[1], gather[1][k])),
+                _mm256_shuffle_epi8(channel[2], gather[2][k])
+            );
+        }
+        // lane 0 holds output bytes 0-47 and lane 1 holds bytes 48-95
+        _mm256_storeu_si256((__m256i*)(rgb+3*i),    _mm256_permute2x128_si256(block[0], block[1], 0x20));
+        _mm256_storeu_si256((__m256i*)(rgb+3*i+32), _mm256_permute2x128_si256(block[2], block[0], 0x30));
+        _mm256_storeu_si256((__m256i*)(rgb+3*i+64), _mm256_permute2x128_si256(block[1], block[2], 0x31));
+    }
+    convert_shade_row_portable(shades+i, rgb+3*i, tables, count-i);
+}
+#endif
+
+
+void init_colour_convert(void) {
+    /* select the fastest shade conversion kernel supported by the host cpu */
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        convert_shade_row = convert_shade_row_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        convert_shade_row = convert_shade_row_ssse3;
+        kernel_name = "ssse3";
+    }
+#endif
+}
+
+
+const char* colour_convert_kernel_name(void) {
+    /* get the name of the currently selected shade conversion kernel */
+    return kernel_name;
+}
@@ -0,0 +1,22 @@
+/* Header file for colour_convert.c, expanding shade indices into RGB texels
+  Author: Max Croucher
+  Email: mpccroucher@gmail.com
+  October 2026
+*/
+
+#ifndef COLOUR_CONVERT_H
+#define COLOUR_CONVERT_H
+
+typedef void (*ShadeRowConverter)(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count);
+
+extern ShadeRowConverter convert_shade_row;
+
+void convert_shade_row_portable(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count);
+#ifdef __x86_64__
+void convert_shade_row_ssse3(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count);
+void convert_shade_row_avx2(const uint8_t *shades, uint8_t *rgb, const uint8_t tables[3][16], int count);
+#endif
+void init_colour_convert(void);
+const char* colour_convert_kernel_name(void);
+
+#endif // COLOUR_CONVERT_H
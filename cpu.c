@@ -14,6 +14,11 @@
 #include "registers.h"
 
 void handle_audio_register(uint16_t addr); // explicity define function declared in dependent translation unit
+void prepare_audio_access(void); // explicity define function declared in dependent translation unit
+void invalidate_tile(uint16_t addr); // explicity define function declared in dependent translation unit
+void invalidate_oam(void); // explicity define function declared in dependent translation unit
+void ppu_register_written(void); // explicity define function declared in dependent translation unit
+void prepare_vram_write(void); // explicity define function declared in dependent translation unit
 
 JoypadState joypad_state = {0,0,0,0,0,0,0,0}; //extern
 Registers reg; //extern
@@ -22,8 +27,10 @@ uint8_t OAM_DMA_starter = 0; //extern
 bool OAM_DMA = 0; //extern
 uint16_t OAM_DMA_timeout = 0; //extern
 uint16_t system_counter = 0xABCE; //extern
+uint64_t cycles_run = 0; //extern, t-cycles since power on, for the APU to catch up to
 uint8_t TIMA_overflow_delay = 0; //extern
 bool TIMA_overflow_flag = 0; //extern
+bool joypad_polled = 0; //extern, set when the game reads JOYP and cleared at VBlank
 bool timer_last_state = 0;
 bool do_div_reset;
 uint16_t div_reset_old_sysclk;
@@ -37,10 +44,11 @@ extern gbRom rom;
 
 void increment_timers(void) {
     /* Handle the incrementing and overflowing of timers */
-    if (do_div_reset) {
+    if (do_div_reset) { // the call from a DIV write, in the same t-cycle, so cycles_run is not counted
         do_div_reset = 0;
     } else {
         system_counter++;
+        cycles_run++;
     }
     bool timer_current_state = 0;
     if ((*(ram+REG_TAC)>>2)&1) { // is timer enabled in TAC
@@ -309,10 +317,11 @@ void write_byte(uint16_t addr, uint8_t byte) {
         return;
     }
     if (addr == REG_DIV) { //writing to DIV sets it to 0, but requires special timer behaviour
+        prepare_audio_access(); // the APU's frame sequencer is clocked by DIV
         div_reset_old_sysclk=system_counter;
         system_counter = 0;
         do_div_reset=1;
-        increment_timers();
+        increment_timers(); // consumes do_div_reset now, so system_counter is 0 for this cycle only and steps on in the next
         return;
     }
 
@@ -338,6 +347,7 @@ void write_byte(uint16_t addr, uint8_t byte) {
     if (addr == REG_STAT) {
         *(ram+addr) &= 0x87;
         *(ram+addr) += byte & 0x78; // only set certain regs
+        ppu_register_written();
         return;
     }
 
@@ -345,6 +355,7 @@ void write_byte(uint16_t addr, uint8_t byte) {
     // if ((*(ram+REG_STAT)&3) && (addr >= 0x8000 && addr < 0xA000)) return; // VRAM inaccessible
 
     if (addr >= 0xFF00 && addr < 0xFF80) { //Special instructions
+        if (addr >= 0xFF10 && addr < 0xFF40) prepare_audio_access(); // the APU runs behind, and must see the old value until now
         uint8_t mask = write_masks[addr&0xFF];
         *(ram+addr) &= ~mask; // set to-be-written bits low
         *(ram+addr) |= byte&mask; // write only the masked bits
@@ -352,9 +363,16 @@ void write_byte(uint16_t addr, uint8_t byte) {
         if (addr >= 0xFF10 && addr < 0xFF3F) { // Audio registers
             handle_audio_register(addr);
         }
+        if (addr == REG_LCDC || addr == REG_LYC) { // PPU state depends on these
+            ppu_register_written();
+        }
         return;
     }
 
+    if (addr >= 0x8000 && addr < 0xA000) prepare_vram_write(); // lines already recorded must be drawn from the old VRAM
+    if (addr >= 0x8000 && addr < 0x9800) invalidate_tile(addr); // tile data changed, so decoded tile is stale
+    if (addr >= 0xFE00 && addr < 0xFEA0) invalidate_oam(); // object attributes changed
+
     *(ram+addr) = byte; // write if nothing else happens
 }
 
@@ -376,11 +394,13 @@ uint8_t read_byte(uint16_t addr) {
     }
 
     if (addr == REG_JOYP) { //reading joypad
+        joypad_polled = 1;
         joypad_io();
         return *(ram+addr);
     }
 
     if (addr >= 0xFF00 && addr < 0xFF80) { //Special instructions
+        if (addr >= 0xFF10 && addr < 0xFF40) prepare_audio_access(); // the APU runs behind, and may have changed NR52, NR13 or the wave position
         return *(ram+addr) | (read_masks[addr&0xFF]); // set unreadable bits high
     }
 
@@ -414,6 +434,7 @@ void read_dma(void) {
         if (high_addr >= 0xE0) high_addr -= 0x20;
         *(ram + 0xFE00 + OAM_DMA_timeout) = *(ram + (high_addr<<8) + OAM_DMA_timeout);
     }
+    invalidate_oam();
     if (OAM_DMA_timeout==160) OAM_DMA = 0;
     OAM_DMA_timeout++;
 }
@@ -432,4 +453,40 @@ void joypad_io(void) {
     if (old_state & ~(*(ram+REG_JOYP) & 0x0F)) {// if any bits were high and are now low
         *(ram+REG_IF) |= 16; // Request a joypad interrupt
     }
-}
\ No newline at end of file
+}
+
+
+void save_cpu_state(CpuState *state) {
+    /* copy the registers, memory map and timers into state */
+    state->reg = reg;
+    memcpy(state->ram, ram, sizeof(state->ram));
+    state->system_counter = system_counter;
+    state->cycles_run = cycles_run;
+    state->OAM_DMA_starter = OAM_DMA_starter;
+    state->OAM_DMA = OAM_DMA;
+    state->OAM_DMA_timeout = OAM_DMA_timeout;
+    state->TIMA_overflow_delay = TIMA_overflow_delay;
+    state->TIMA_overflow_flag = TIMA_overflow_flag;
+    state->joypad_polled = joypad_polled;
+    state->timer_last_state = timer_last_state;
+    state->do_div_reset = do_div_reset;
+    state->div_reset_old_sysclk = div_reset_old_sysclk;
+}
+
+
+void load_cpu_state(const CpuState *state) {
+    /* restore the registers, memory map and timers saved by save_cpu_state */
+    reg = state->reg;
+    memcpy(ram, state->ram, sizeof(state->ram));
+    system_counter = state->system_counter;
+    cycles_run = state->cycles_run;
+    OAM_DMA_starter = state->OAM_DMA_starter;
+    OAM_DMA = state->OAM_DMA;
+    OAM_DMA_timeout = state->OAM_DMA_timeout;
+    TIMA_overflow_delay = state->TIMA_overflow_delay;
+    TIMA_overflow_flag = state->TIMA_overflow_flag;
+    joypad_polled = state->joypad_polled;
+    timer_last_state = state->timer_last_state;
+    do_div_reset = state->do_div_reset;
+    div_reset_old_sysclk = state->div_reset_old_sysclk;
+}
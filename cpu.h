@@ -32,6 +32,22 @@ typedef struct {
     bool right;
 } JoypadState;
 
+typedef struct {
+    Registers reg;
+    uint8_t ram[0x10000];
+    uint16_t system_counter;
+    uint64_t cycles_run;
+    uint8_t OAM_DMA_starter;
+    bool OAM_DMA;
+    uint16_t OAM_DMA_timeout;
+    uint8_t TIMA_overflow_delay;
+    bool TIMA_overflow_flag;
+    bool joypad_polled;
+    bool timer_last_state;
+    bool do_div_reset;
+    uint16_t div_reset_old_sysclk;
+} CpuState;
+
 
 typedef enum registers{
     REG_JOYP   = 0xff00,
@@ -141,5 +157,7 @@ void write_word(uint16_t addr, uint16_t word);
 uint16_t read_word(uint16_t addr);
 void read_dma(void);
 void joypad_io(void);
+void save_cpu_state(CpuState *state);
+void load_cpu_state(const CpuState *state);
 
 #endif // CPU_H
\ No newline at end of file
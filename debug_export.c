@@ -0,0 +1,76 @@
+/* Source file for debug_export.c, sharing the PPU state with gbemu-viewer.
+    Once per frame, VRAM, OAM, the PPU registers and the framebuffer are copied into
+    a POSIX shared memory segment. The copy is guarded by a sequence counter: it is
+    made odd before writing and even afterwards, so the viewer can tell when it read
+    a frame that was being written and try again. The emulator never waits for the
+    viewer, and does no debug drawing of its own.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "debug_export.h"
+
+static DebugExport *shared = NULL;
+
+
+bool init_debug_export(void) {
+    /* create the shared memory segment. Returns 0 if it could not be created */
+    int fd = shm_open(DEBUG_EXPORT_NAME, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("Could not create the debug export");
+        return 0;
+    }
+    if (ftruncate(fd, sizeof(DebugExport))) {
+        perror("Could not size the debug export");
+        close(fd);
+        shm_unlink(DEBUG_EXPORT_NAME);
+        return 0;
+    }
+    shared = mmap(NULL, sizeof(DebugExport), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("Could not map the debug export");
+        shared = NULL;
+        shm_unlink(DEBUG_EXPORT_NAME);
+        return 0;
+    }
+    memset(shared, 0, sizeof(DebugExport));
+    shared->version = DEBUG_EXPORT_VERSION;
+    fprintf(stderr, "Exporting PPU state to shared memory %s\n", DEBUG_EXPORT_NAME);
+    return 1;
+}
+
+
+void export_debug_state(const uint8_t *ram, const uint8_t framebuffer[144][160], uint8_t window_line, uint32_t lag_frames) {
+    /* copy the state of a finished frame into the shared memory segment */
+    if (!shared) return;
+    unsigned int sequence = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shared->sequence, sequence+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // the odd sequence is visible before any of the new data
+    memcpy(shared->vram, ram+0x8000, sizeof(shared->vram));
+    memcpy(shared->oam, ram+0xFE00, sizeof(shared->oam));
+    memcpy(shared->registers, ram+0xFF40, sizeof(shared->registers));
+    memcpy(shared->framebuffer, framebuffer, sizeof(shared->framebuffer));
+    shared->window_line = window_line;
+    shared->lag_frames = lag_frames;
+    shared->frame++;
+    atomic_store_explicit(&shared->sequence, sequence+2, memory_order_release);
+}
+
+
+void close_debug_export(void) {
+    /* unmap and remove the shared memory segment */
+    if (!shared) return;
+    munmap(shared, sizeof(DebugExport));
+    shm_unlink(DEBUG_EXPORT_NAME);
+    shared = NULL;
+}
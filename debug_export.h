@@ -0,0 +1,29 @@
+/* Header file for debug_export.c, sharing the PPU state with gbemu-viewer
+  Author: Max Croucher
+  Email: mpccroucher@gmail.com
+  October 2026
+*/
+
+#ifndef DEBUG_EXPORT_H
+#define DEBUG_EXPORT_H
+
+#define DEBUG_EXPORT_NAME "/gbemu-debug"
+#define DEBUG_EXPORT_VERSION 2
+
+typedef struct {
+    uint32_t version; // DEBUG_EXPORT_VERSION, checked by the viewer before reading anything else
+    atomic_uint sequence; // odd while the emulator is writing a frame
+    uint32_t frame; // frames exported so far
+    uint8_t vram[0x2000]; // 0x8000-0x9FFF
+    uint8_t oam[0xA0]; // 0xFE00-0xFE9F
+    uint8_t registers[0x0C]; // 0xFF40-0xFF4B: LCDC, STAT, SCY, SCX, LY, LYC, DMA, BGP, OBP0, OBP1, WY, WX
+    uint8_t window_line; // window lines drawn in the exported frame
+    uint32_t lag_frames; // frames in which the game did not read the joypad
+    uint8_t framebuffer[144][160]; // shade of every pixel, top row first
+} DebugExport;
+
+bool init_debug_export(void);
+void export_debug_state(const uint8_t *ram, const uint8_t framebuffer[144][160], uint8_t window_line, uint32_t lag_frames);
+void close_debug_export(void);
+
+#endif // DEBUG_EXPORT_H
@@ -9,55 +9,181 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#define GL_GLEXT_PROTOTYPES // pixel buffer objects are called directly
 #include <GL/freeglut.h>
 #include <time.h>
+#include <errno.h>
 #include <png.h>
 #include "cpu.h"
 #include "rom.h"
 #include "graphics.h"
+#include "tile_decode.h"
+#include "colour_convert.h"
+#include "scanline.h"
+#include "upscale.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include "debug_export.h"
 
 extern uint8_t* ram;
 extern uint8_t* rom;
 extern JoypadState joypad_state;
 extern bool LOOP;
 extern bool hyperspeed;
+extern bool audio_sync;
 extern bool debug_tilemap;
 extern bool debug_scanlines;
 extern bool dmg_colours;
 extern bool frame_by_frame;
+extern bool render_thread;
+extern int frameskip;
+extern bool headless;
+extern bool accurate_ppu;
+extern bool present_thread;
+extern bool export_debug;
+extern bool skip_lag_frames;
+extern bool joypad_polled;
+extern int upscale_filter;
 extern char* save_filename;
 extern bool do_save_game;
 
 
-clock_t start,end;
-double rolling_frametime = 0;
-uint8_t framecount_offset = 0;
-uint8_t frame_report_offset = 0;
 
 #define SCREEN_WIDTH 160
 #define SCREEN_HEIGHT 144
-#define FRAMETIME_BUFSIZE 10
-#define TARGET_FRAMETIME 0.016742706
-#define FRAMETIME_REPORT_INTERVAL 12
-double calibrated_frametime = TARGET_FRAMETIME;
+#define FRAME_NS 16742706 // 59.73Hz
+#define SPIN_NS 500000 // the end of each wait is spent spinning, as sleeping can overshoot by up to this much
+#define FRAMERATE_REPORT_INTERVAL 120 // frames between updates of the framerate in the window title
+#define JITTER_BUCKET_NS 100000
+#define JITTER_BUCKETS 21 // the last bucket holds every frame shown later than the others cover
+#define DEBUG_VIEW_INTERVAL_NS 33333333 // the debug window is refreshed at most 30 times a second
+#define FRAMESKIP_AUTO -1
+#define MAX_AUTO_FRAMESKIP 4 // frames skipped in a row before one is drawn regardless
+#define MAX_HIDDEN_LAG_FRAMES 4 // longer runs of lag frames are shown, as the game is not reading the joypad at all
+#define SHADE_BLANK 4 // shade shown while the LCD is off
+#define SHADE_MARKER 5 // shade used to highlight tile boundaries when debugging
+#define DOTS_PER_LINE 456
+#define DOTS_PER_FRAME 70224
+#define VBLANK_DOT 65564
+#define ACCURATE_VBLANK_DOT (SCREEN_HEIGHT*DOTS_PER_LINE)
+#define MIN_MODE3_LENGTH 172
+#define NO_PPU_EVENT UINT32_MAX // the dot counter is stopped while the LCD is off
+#define VRAM_SNAPSHOTS 4
+// LCDC bits with a specialised line renderer for each combination: object size, background map,
+// tile addressing and window map. They are packed into a 4-bit key to index line_renderers
+#define LCDC_KEY_BITS 0x5C
+#define KEY_FROM_LCDC(lcdc) ((((lcdc)>>2)&7) | (((lcdc)>>3)&8))
+#define LCDC_FROM_KEY(key) ((((key)&7)<<2) | (((key)&8)<<3))
+#define LINES_PER_SUBMIT 16 // recorded lines are handed to the render worker in groups, so it is woken less often
+#define FRAME_INDEX_MASK 3
+#define FRAME_FRESH 4 // set in present_shared when the frame it holds has not been shown yet
+#define KEY_EVENT_QUEUE_SIZE 64 // must be a power of 2
+#define PRESENT_IDLE_NS 1000000 // presentation thread sleep when there is no new frame or input
+#define MAX_SPEED_MULTIPLIER 4 // fast forward steps through 2x and 4x before uncapping
+#define SPEED_SMOOTHING 0.1 // weight of the latest frame in the measured speed while fast forwarding
+uint64_t frame_deadline = 0; // time the current frame is due to be shown, 0 before the first frame
+uint64_t frame_work_start = 0; // time emulation of the current frame started
+uint64_t last_framerate_report = 0;
+uint8_t frames_since_report = 0;
+uint32_t jitter_histogram[JITTER_BUCKETS] = {0}; // how late each paced frame was shown
+uint64_t jitter_total_ns = 0;
+uint64_t jitter_worst_ns = 0;
+bool frame_overran = 0; // the last frame took longer to emulate than it should take to show
+bool skip_frame = 0; // the current frame generates no pixels
+bool lag_frame = 0; // the game did not read the joypad between the last two VBlanks
+uint32_t lag_frames = 0;
+uint32_t vblanks = 0;
+uint32_t lag_run = 0; // lag frames in a row up to the last one shown
+uint32_t lag_frames_reported = 0; // lag_frames and vblanks at the last framerate report
+uint32_t vblanks_reported = 0;
+bool frame_hidden = 0; // the current frame is run for run-ahead, and is neither drawn nor shown
+bool skip_after_hidden = 0; // skip decision for the next frame that is shown
+int frames_skipped = 0;
+uint64_t last_drawn_frame = 0;
+int speed_multiplier = 1; // frames paced per 59.7Hz frame, unless uncapped by hyperspeed
+double emulation_speed = 1.0; //extern, speed relative to the gameboy, used to time stretch audio
 
 char rom_name[16];
-char window_name[32];
+char window_name[48];
 uint8_t xoffset = 0;
 static uint32_t dot = 0;
+static uint32_t next_event_dot = 0; // next dot at which LY, STAT or the PPU mode can change
+static uint16_t hblank_position = 80 + MIN_MODE3_LENGTH; // dot within the line at which the accurate engine enters HBlank
 uint8_t window_internal_counter = 0;
 GLint WindowMain = 1;
 GLint WindowDebug = 2;
 GLubyte texture[SCREEN_HEIGHT][SCREEN_WIDTH][3];
+GLubyte present_frames[3][SCREEN_HEIGHT][SCREEN_WIDTH][3]; // triple buffer shared with the presentation thread
+atomic_int present_shared = 0; // index of the buffer exchanged between the threads, or'd with FRAME_FRESH
+int present_write = 1; // buffer owned by the emulation thread
+int present_read = 2; // buffer owned by the presentation thread
+GLubyte (*displayed_frame)[SCREEN_WIDTH][3] = texture; // frame drawn by gl_tick
+KeyEvent key_events[KEY_EVENT_QUEUE_SIZE]; // input passed from the presentation thread to the emulation thread
+atomic_uint key_events_written = 0; // only advanced by the presentation thread
+atomic_uint key_events_read = 0; // only advanced by the emulation thread
+pthread_mutex_t title_lock = PTHREAD_MUTEX_INITIALIZER;
+bool title_changed = 0;
+int *present_argc;
+char **present_argv;
+uint8_t framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH]; // shade of every pixel, top row first. Expanded into texture once per frame
+uint8_t shade_tables[3][16]; // red, green and blue value of each shade
+bool shade_tables_valid = 0;
+uint8_t palette_luts[256][4]; // shade of each colour id for every possible palette register value
 GLubyte bg_tilemap[256][256][3];
+GLubyte bg_tilemap_tiles[256][256][3]; // background map without the viewport drawn over it
+uint8_t debug_vram_shadow[0x2000]; // VRAM when the debug views were last drawn
+uint8_t debug_oam_shadow[0xA0]; // OAM when the debug views were last drawn
+uint8_t debug_view_registers[4]; // LCDC, BGP, OBP0 and OBP1 when the debug views were last drawn
+bool debug_views_valid = 0;
+uint64_t debug_views_drawn = 0; // time the debug views were last refreshed
+GLuint debug_label_list = 0; // display list of the debug window's labels that never change
 GLubyte window_tilemap[256][256][3];
 GLubyte object_tilemap[16][320][3];
 GLubyte vram_block_1[32][256][3];
 GLubyte vram_block_2[32][256][3];
 GLubyte vram_block_3[32][256][3];
-bool bgw_priority_map[SCREEN_HEIGHT][SCREEN_WIDTH];
-ObjectAttribute objects[10];
-uint8_t objects_found = 0;
+TextureSurface main_surface = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, NULL};
+TextureSurface bg_tilemap_surface = {0, 0, 256, 256, NULL};
+TextureSurface window_tilemap_surface = {0, 0, 256, 256, NULL};
+TextureSurface object_tilemap_surface = {0, 0, 320, 16, NULL};
+TextureSurface vram_block_surfaces[3] = {{0, 0, 256, 32, NULL}, {0, 0, 256, 32, NULL}, {0, 0, 256, 32, NULL}};
+TextureSurface upscaled_surface = {0, 0, 0, 0, NULL}; // sized for the filter when the upscale worker starts
+uint8_t upscale_input[SCREEN_HEIGHT][SCREEN_WIDTH]; // finished frame handed to the upscale worker
+uint8_t upscaled_shades[SCREEN_HEIGHT*3][SCREEN_WIDTH*3];
+GLubyte upscaled_frames[2][SCREEN_HEIGHT*3*SCREEN_WIDTH*3*3]; // RGB output of the upscale worker, top row first
+int upscaled_shown = 0; // output buffer gl_tick shows, the worker draws into the other one
+bool upscale_pending = 0; // upscale_input holds a frame the worker has not started on
+bool upscale_ready = 0; // the worker has finished at least one frame
+atomic_bool upscale_fresh = 0; // the worker has finished a frame that has not been shown
+pthread_mutex_t upscale_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upscale_requested = PTHREAD_COND_INITIALIZER;
+uint8_t previous_framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH]; // last frame shown, to skip showing identical frames
+bool previous_frame_valid = 0;
+bool bgw_priority_map[SCREEN_HEIGHT][SCREEN_WIDTH]; // set where the background or window is not colour 0, top row first
+uint8_t tile_cache[384][8][8]; // every tile in VRAM, decoded to one colour id per pixel
+bool tile_cache_valid[384] = {0}; // cleared by writes to VRAM tile data
+ObjectAttribute scanned_objects[SCREEN_HEIGHT][10]; // objects selected during each scanline's OAM scan, sorted by xpos
+uint8_t scanned_object_count[SCREEN_HEIGHT];
+LineState line_states[SCREEN_HEIGHT]; // PPU registers latched as each scanline entered mode 3
+uint8_t pending_lines[SCREEN_HEIGHT]; // scanlines recorded but not yet drawn, in the order they were recorded
+uint8_t pending_line_count = 0;
+const uint8_t *line_vram[SCREEN_HEIGHT]; // VRAM the render worker draws each recorded line from: live VRAM or a snapshot
+uint8_t vram_snapshots[VRAM_SNAPSHOTS][0x2000]; // copies of VRAM taken when it is written while undrawn lines still refer to it
+uint8_t snapshot_users[VRAM_SNAPSHOTS] = {0}; // number of undrawn lines that refer to each snapshot
+bool live_vram_in_use = 0; // an undrawn line refers to live VRAM
+uint8_t submitted_line_count = 0; // pending lines the render worker may draw
+uint8_t drawn_line_count = 0; // pending lines the render worker has drawn
+const uint8_t *worker_vram = NULL; // VRAM of the line the render worker is drawing, NULL while it waits
+pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lines_submitted = PTHREAD_COND_INITIALIZER;
+pthread_cond_t lines_drawn = PTHREAD_COND_INITIALIZER;
+
+static void start_render_worker(void);
+ObjectAttribute oam_shadow[40]; // decoded copy of OAM
+uint8_t line_objects[SCREEN_HEIGHT][10]; // OAM index of the first 10 objects on each scanline
+uint8_t line_object_count[SCREEN_HEIGHT];
+bool oam_index_valid = 0; // cleared by writes to OAM
+bool oam_index_tall = 0; // object size the index was built for
 uint8_t pixvals[5][3] = {{0xF8,0xF8,0xF8}, {0xA0,0xA0,0xA0}, {0x50,0x50,0x50}, {0x00,0x00,0x00}, {0xFF,0xFF,0xFF}};
 uint8_t dmgcols[5][3] = {{155,188,15},{139,172,15},{48,98,48},{15,56,15},{155*1.2,188*1.2,15*1.2}};
 uint8_t priority_object[SCREEN_WIDTH];
@@ -68,35 +194,175 @@ int debug_frameskip = 0; //extern
 int debug_frames_done = 0;
 
 
+static inline uint64_t monotonic_ns(void) {
+    /* wall clock time in nanoseconds, unaffected by changes to the system time */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+
+static bool choose_frame_skip(void) {
+    /* decide whether the next frame is skipped. Skipped frames still run every PPU mode and interrupt,
+    but generate no pixels and are not shown. The automatic mode skips when drawing cannot keep up,
+    or at max speed, when a frame was already shown within the last 1/60th of a second */
+    if (debug_scanlines) return 0;
+    if (frameskip == FRAMESKIP_AUTO) {
+        if (frames_skipped >= MAX_AUTO_FRAMESKIP) return 0;
+        if (hyperspeed) return monotonic_ns() - last_drawn_frame < FRAME_NS;
+        return frame_overran;
+    }
+    return frames_skipped < frameskip;
+}
+
+
+static void record_jitter(uint64_t lateness) {
+    /* add how late a frame was shown to the jitter histogram */
+    uint64_t bucket = lateness / JITTER_BUCKET_NS;
+    jitter_histogram[bucket < JITTER_BUCKETS-1 ? bucket : JITTER_BUCKETS-1]++;
+    jitter_total_ns += lateness;
+    if (lateness > jitter_worst_ns) jitter_worst_ns = lateness;
+}
+
+
 static inline void framerate(void) {
-    /* run at the start of VBLANK to compute framerate and add delay to target 59.73Hz */
-    double raw_frametime = ((double)(clock()-start)) / CLOCKS_PER_SEC;
-    if (!hyperspeed) {
-        double catchup = calibrated_frametime - raw_frametime;
-        struct timespec waittime;
-        waittime.tv_sec = 0;
-        waittime.tv_nsec = (long int)(1000000000 * catchup);
-        nanosleep(&waittime, &waittime);
-        raw_frametime = catchup + ((double)(clock()-start)) / CLOCKS_PER_SEC;
-    }
-
-    rolling_frametime += raw_frametime;
-    framecount_offset++;
-    if (framecount_offset == FRAMETIME_BUFSIZE) {
-        framecount_offset = 0;
-        if (frame_report_offset == FRAMETIME_REPORT_INTERVAL) {
-            frame_report_offset = 0;
-            sprintf(window_name, "%s | %.1fHz", rom_name, 1.0/(rolling_frametime/FRAMETIME_BUFSIZE));
+    /* run at the start of VBLANK to wait for the frame's deadline and report the framerate. Deadlines are
+    absolute and advance by exactly one frame, so an early or late wake up is not carried into later frames.
+    Most of the wait is slept, and the end is spun to avoid oversleeping */
+    uint64_t now = monotonic_ns();
+    frame_overran = now - frame_work_start > FRAME_NS / speed_multiplier;
+    if (!hyperspeed && !audio_sync) { // with audio sync, frames are shown as soon as they are emulated
+        if (frame_deadline) {
+            frame_deadline += FRAME_NS / speed_multiplier;
+        } else {
+            frame_deadline = now;
+        }
+        if (frame_deadline > now + SPIN_NS) {
+            uint64_t wake = frame_deadline - SPIN_NS;
+            struct timespec waittime = {wake / 1000000000, wake % 1000000000};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &waittime, NULL) == EINTR);
+        }
+        while (now < frame_deadline) now = monotonic_ns();
+        record_jitter(now - frame_deadline);
+        if (now - frame_deadline > FRAME_NS / speed_multiplier) frame_deadline = now; // too far behind to catch up, so pace from here
+    } else {
+        frame_deadline = 0; // pacing restarts from the next frame when the limit is restored
+    }
+    if ((hyperspeed || speed_multiplier > 1) && now > frame_work_start) {
+        // follow how fast frames are actually emulated and paced, which a slow host may keep below the multiplier
+        emulation_speed += SPEED_SMOOTHING * ((double)FRAME_NS / (now - frame_work_start) - emulation_speed);
+        if (!hyperspeed && emulation_speed > speed_multiplier) emulation_speed = speed_multiplier;
+    }
+
+    frames_since_report++;
+    if (frames_since_report == FRAMERATE_REPORT_INTERVAL) {
+        double framerate_hz = (double)FRAMERATE_REPORT_INTERVAL * 1000000000 / (now - last_framerate_report);
+        // the counts are rewound along with the PPU, so frames only emulated for run ahead are not included
+        uint32_t frames_counted = vblanks - vblanks_reported;
+        int lag_percent = frames_counted ? (lag_frames - lag_frames_reported) * 100 / frames_counted : 0;
+        if (present_thread) { // the title is set by the thread which owns the window
+            pthread_mutex_lock(&title_lock);
+            sprintf(window_name, "%s | %.1fHz | %d%% lag", rom_name, framerate_hz, lag_percent);
+            title_changed = 1;
+            pthread_mutex_unlock(&title_lock);
+        } else {
+            sprintf(window_name, "%s | %.1fHz | %d%% lag", rom_name, framerate_hz, lag_percent);
             glutSetWindowTitle(window_name);
         }
-        frame_report_offset++;
-        if (!hyperspeed) {
-            double frametime_error = TARGET_FRAMETIME - rolling_frametime/FRAMETIME_BUFSIZE;
-            calibrated_frametime += frametime_error/2;
+        frames_since_report = 0;
+        lag_frames_reported = lag_frames;
+        vblanks_reported = vblanks;
+        last_framerate_report = now;
+    }
+    frame_work_start = now;
+}
+
+
+void print_frame_jitter(void) {
+    /* print a histogram of how late paced frames were shown */
+    uint32_t frames = 0;
+    for (int i=0; i<JITTER_BUCKETS; i++) frames += jitter_histogram[i];
+    if (!frames) {
+        printf("frame pacing: no paced frames\n");
+        return;
+    }
+    printf("frame pacing: %u frames, mean lateness %.3fms, worst %.3fms\n", frames, jitter_total_ns / 1e6 / frames, jitter_worst_ns / 1e6);
+    for (int i=0; i<JITTER_BUCKETS; i++) {
+        if (!jitter_histogram[i]) continue;
+        if (i == JITTER_BUCKETS-1) {
+            printf("   >%.1fms: %u\n", i * JITTER_BUCKET_NS / 1e6, jitter_histogram[i]);
+        } else {
+            printf("  %.1f-%.1fms: %u\n", i * JITTER_BUCKET_NS / 1e6, (i+1) * JITTER_BUCKET_NS / 1e6, jitter_histogram[i]);
         }
-        rolling_frametime = 0;
     }
-    start = clock();
+}
+
+
+static void create_surface(TextureSurface *surface, const GLubyte *pixels) {
+    /* create the texture for a surface in the current GL context, and a pixel buffer to stream updates through */
+    size_t size = surface->width*surface->height*3;
+    glGenTextures(1, &surface->texture);
+    glBindTexture(GL_TEXTURE_2D, surface->texture);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D,0,3,surface->width,surface->height,0,GL_RGB, GL_UNSIGNED_BYTE, pixels);
+    surface->uploaded = malloc(size);
+    memcpy(surface->uploaded, pixels, size);
+    if (glutExtensionSupported("GL_ARB_pixel_buffer_object")) {
+        glGenBuffers(1, &surface->pixel_buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, surface->pixel_buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+}
+
+
+static void upload_surface(TextureSurface *surface, const GLubyte *pixels) {
+    /* bind a surface's texture and bring it up to date with pixels. Only rows that differ from the last
+    upload are sent, one glTexSubImage2D per run of changed rows, through the pixel buffer if there is one */
+    if (!surface->texture) {
+        create_surface(surface, pixels);
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, surface->texture);
+    size_t row_size = surface->width*3;
+    bool changed[surface->height];
+    bool any_changed = 0;
+    for (int y=0; y<surface->height; y++) {
+        changed[y] = memcmp(surface->uploaded + y*row_size, pixels + y*row_size, row_size);
+        if (changed[y]) memcpy(surface->uploaded + y*row_size, pixels + y*row_size, row_size);
+        any_changed |= changed[y];
+    }
+    if (!any_changed) return;
+
+    const GLubyte *source = pixels;
+    if (surface->pixel_buffer) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, surface->pixel_buffer);
+        // orphan the buffer so the driver does not wait for the previous upload to finish
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, row_size*surface->height, NULL, GL_STREAM_DRAW);
+        GLubyte *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (mapped) {
+            for (int y=0; y<surface->height; y++) {
+                if (changed[y]) memcpy(mapped + y*row_size, pixels + y*row_size, row_size);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            source = NULL; // offsets are now relative to the start of the pixel buffer
+        } else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+    for (int y=0; y<surface->height;) {
+        if (!changed[y]) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while (y < surface->height && changed[y]) y++;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, surface->width, y-first, GL_RGB, GL_UNSIGNED_BYTE, source + first*row_size);
+    }
+    if (!source) glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 
@@ -105,16 +371,22 @@ void gl_tick(void) {
     glClear(GL_COLOR_BUFFER_BIT);
     glPushMatrix();
     glEnable(GL_TEXTURE_2D);
-    glTexImage2D(GL_TEXTURE_2D,0,3,SCREEN_WIDTH,SCREEN_HEIGHT,0,GL_RGB, GL_UNSIGNED_BYTE, texture);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    bool upscaled = 0;
+    if (upscale_filter) {
+        pthread_mutex_lock(&upscale_lock); // keeps the worker from swapping buffers during the upload
+        if (upscale_ready) {
+            upload_surface(&upscaled_surface, upscaled_frames[upscaled_shown]);
+            upscaled = 1;
+        }
+        pthread_mutex_unlock(&upscale_lock);
+    }
+    if (!upscaled) upload_surface(&main_surface, displayed_frame[0][0]);
+    float bottom = upscaled; // upscaled frames are stored top row first, so they are drawn flipped
     glBegin(GL_POLYGON);
-        glTexCoord2f(0,0); glVertex2f(0,0);
-        glTexCoord2f(0,1); glVertex2f(0,1);
-        glTexCoord2f(1,1); glVertex2f(1,1);
-        glTexCoord2f(1,0); glVertex2f(1,0);
+        glTexCoord2f(0,bottom); glVertex2f(0,0);
+        glTexCoord2f(0,1-bottom); glVertex2f(0,1);
+        glTexCoord2f(1,1-bottom); glVertex2f(1,1);
+        glTexCoord2f(1,bottom); glVertex2f(1,0);
     glEnd();
 	glDisable(GL_TEXTURE_2D);
 
@@ -175,71 +447,102 @@ static inline void highlight_object(uint8_t i) {
 
 }
 
+static void draw_static_labels(void) {
+    /* draw the address labels around the tilemaps, objects and VRAM blocks on the debug window */
+    draw_text(0.00222,0.4, GLUT_BITMAP_9_BY_15, "0x00");
+    draw_text(1.6/9,0.4, GLUT_BITMAP_9_BY_15, "0x08");
+    draw_text(3.2/9,0.4, GLUT_BITMAP_9_BY_15, "0x10");
+    draw_text(0.09111,0.19, GLUT_BITMAP_9_BY_15, "0x18");
+    draw_text(0.26888,0.19, GLUT_BITMAP_9_BY_15, "0x20");
+
+    draw_text(0.505,54.0/64, GLUT_BITMAP_9_BY_15, "0x8000");
+    draw_text(0.505,51.0/64, GLUT_BITMAP_9_BY_15, "0x8200");
+    draw_text(0.505,48.0/64, GLUT_BITMAP_9_BY_15, "0x8400");
+    draw_text(0.505,45.0/64, GLUT_BITMAP_9_BY_15, "0x8600");
+    draw_text(0.505,34.0/64, GLUT_BITMAP_9_BY_15, "0x8800");
+    draw_text(0.505,31.0/64, GLUT_BITMAP_9_BY_15, "0x8A00");
+    draw_text(0.505,28.0/64, GLUT_BITMAP_9_BY_15, "0x8C00");
+    draw_text(0.505,25.0/64, GLUT_BITMAP_9_BY_15, "0x8E00");
+    draw_text(0.505,14.0/64, GLUT_BITMAP_9_BY_15, "0x9000");
+    draw_text(0.505,11.0/64, GLUT_BITMAP_9_BY_15, "0x9200");
+    draw_text(0.505,08.0/64, GLUT_BITMAP_9_BY_15, "0x9400");
+    draw_text(0.505,05.0/64, GLUT_BITMAP_9_BY_15, "0x9600");
+    for (float i=33; i<140; i+=40) {
+        draw_text(39.0/72,i/128, GLUT_BITMAP_9_BY_15, "000");
+        draw_text(41.0/72,i/128, GLUT_BITMAP_9_BY_15, "020");
+        draw_text(43.0/72,i/128, GLUT_BITMAP_9_BY_15, "040");
+        draw_text(45.0/72,i/128, GLUT_BITMAP_9_BY_15, "060");
+        draw_text(47.0/72,i/128, GLUT_BITMAP_9_BY_15, "080");
+        draw_text(49.0/72,i/128, GLUT_BITMAP_9_BY_15, "0A0");
+        draw_text(51.0/72,i/128, GLUT_BITMAP_9_BY_15, "0C0");
+        draw_text(53.0/72,i/128, GLUT_BITMAP_9_BY_15, "0E0");
+        draw_text(55.0/72,i/128, GLUT_BITMAP_9_BY_15, "100");
+        draw_text(57.0/72,i/128, GLUT_BITMAP_9_BY_15, "120");
+        draw_text(59.0/72,i/128, GLUT_BITMAP_9_BY_15, "140");
+        draw_text(61.0/72,i/128, GLUT_BITMAP_9_BY_15, "160");
+        draw_text(63.0/72,i/128, GLUT_BITMAP_9_BY_15, "180");
+        draw_text(65.0/72,i/128, GLUT_BITMAP_9_BY_15, "1A0");
+        draw_text(67.0/72,i/128, GLUT_BITMAP_9_BY_15, "1C0");
+        draw_text(69.0/72,i/128, GLUT_BITMAP_9_BY_15, "1E0");
+    }
+    for (float i=0.5; i<50; i+=46.7) {
+        for (int j=0; j<16; j++) {
+            float ypos = 122.8 - 4*j;
+            char c[2] = {(j%8)*2 + (j%8 > 4 ? 55 : 48), 0};
+            draw_text(i/108, ypos/128, GLUT_BITMAP_HELVETICA_10, c);
+        }
+    }
+    for (float i=1.1; i<50; i+= 30) {
+        for (int j=0; j<16; j++) {
+            float xpos = i + j;
+            char c[2] = {(j%8)*2 + (j%8 > 4 ? 55 : 48), 0};
+            draw_text(xpos/108, 125.0/128, GLUT_BITMAP_HELVETICA_10, c);
+        }
+    }
+}
+
+
 void gl_tick_debug_window(void) {
     /* update debug window */
     glClear(GL_COLOR_BUFFER_BIT);
     glPushMatrix();
     glEnable(GL_TEXTURE_2D);
-    glTexImage2D(GL_TEXTURE_2D,0,3,256,256,0,GL_RGB, GL_UNSIGNED_BYTE, bg_tilemap);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&bg_tilemap_surface, bg_tilemap[0][0]);
     glBegin(GL_POLYGON);
         glTexCoord2f(0,0); glVertex2f(0.25/27,0.475);
         glTexCoord2f(0,1); glVertex2f(0.25/27,0.975);
         glTexCoord2f(1,1); glVertex2f(4.25/27,0.975);
         glTexCoord2f(1,0); glVertex2f(4.25/27,0.475);
     glEnd();
-    glTexImage2D(GL_TEXTURE_2D,0,3,256,256,0,GL_RGB, GL_UNSIGNED_BYTE, window_tilemap);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&window_tilemap_surface, window_tilemap[0][0]);
     glBegin(GL_POLYGON);
         glTexCoord2f(0,0); glVertex2f(7.75/27,0.475);
         glTexCoord2f(0,1); glVertex2f(7.75/27,0.975);
         glTexCoord2f(1,1); glVertex2f(11.75/27,0.975);
         glTexCoord2f(1,0); glVertex2f(11.75/27,0.475);
     glEnd();
-    glTexImage2D(GL_TEXTURE_2D,0,3,256,32,0,GL_RGB, GL_UNSIGNED_BYTE, vram_block_3);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&vram_block_surfaces[2], vram_block_3[0][0]);
     glBegin(GL_POLYGON);
         glTexCoord2f(0,0); glVertex2f(39.0/72,04.0/64);
         glTexCoord2f(0,1); glVertex2f(39.0/72,16.0/64);
         glTexCoord2f(1,1); glVertex2f(71.0/72,16.0/64);
         glTexCoord2f(1,0); glVertex2f(71.0/72,04.0/64);
     glEnd();
-    glTexImage2D(GL_TEXTURE_2D,0,3,256,32,0,GL_RGB, GL_UNSIGNED_BYTE, vram_block_2);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&vram_block_surfaces[1], vram_block_2[0][0]);
     glBegin(GL_POLYGON);
         glTexCoord2f(0,0); glVertex2f(39.0/72,24.0/64);
         glTexCoord2f(0,1); glVertex2f(39.0/72,36.0/64);
         glTexCoord2f(1,1); glVertex2f(71.0/72,36.0/64);
         glTexCoord2f(1,0); glVertex2f(71.0/72,24.0/64);
     glEnd();
-    glTexImage2D(GL_TEXTURE_2D,0,3,256,32,0,GL_RGB, GL_UNSIGNED_BYTE, vram_block_1);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&vram_block_surfaces[0], vram_block_1[0][0]);
     glBegin(GL_POLYGON);
         glTexCoord2f(0,0); glVertex2f(39.0/72,44.0/64);
         glTexCoord2f(0,1); glVertex2f(39.0/72,56.0/64);
         glTexCoord2f(1,1); glVertex2f(71.0/72,56.0/64);
         glTexCoord2f(1,0); glVertex2f(71.0/72,44.0/64);
     glEnd();
-    glTexImage2D(GL_TEXTURE_2D,0,3,320,16,0,GL_RGB, GL_UNSIGNED_BYTE, object_tilemap);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    upload_surface(&object_tilemap_surface, object_tilemap[0][0]);
     for (int i=0; i<20; i++) {
         object_map_draw_quad(i);
     }
@@ -278,55 +581,13 @@ void gl_tick_debug_window(void) {
     sprintf(string, "Frames Rendered: %d", debug_frames_done);
     draw_text(0.16,0.51, GLUT_BITMAP_9_BY_15, string);
 
-    draw_text(0.00222,0.4, GLUT_BITMAP_9_BY_15, "0x00");
-    draw_text(1.6/9,0.4, GLUT_BITMAP_9_BY_15, "0x08");
-    draw_text(3.2/9,0.4, GLUT_BITMAP_9_BY_15, "0x10");
-    draw_text(0.09111,0.19, GLUT_BITMAP_9_BY_15, "0x18");
-    draw_text(0.26888,0.19, GLUT_BITMAP_9_BY_15, "0x20");
-
-    draw_text(0.505,54.0/64, GLUT_BITMAP_9_BY_15, "0x8000");
-    draw_text(0.505,51.0/64, GLUT_BITMAP_9_BY_15, "0x8200");
-    draw_text(0.505,48.0/64, GLUT_BITMAP_9_BY_15, "0x8400");
-    draw_text(0.505,45.0/64, GLUT_BITMAP_9_BY_15, "0x8600");
-    draw_text(0.505,34.0/64, GLUT_BITMAP_9_BY_15, "0x8800");
-    draw_text(0.505,31.0/64, GLUT_BITMAP_9_BY_15, "0x8A00");
-    draw_text(0.505,28.0/64, GLUT_BITMAP_9_BY_15, "0x8C00");
-    draw_text(0.505,25.0/64, GLUT_BITMAP_9_BY_15, "0x8E00");
-    draw_text(0.505,14.0/64, GLUT_BITMAP_9_BY_15, "0x9000");
-    draw_text(0.505,11.0/64, GLUT_BITMAP_9_BY_15, "0x9200");
-    draw_text(0.505,08.0/64, GLUT_BITMAP_9_BY_15, "0x9400");
-    draw_text(0.505,05.0/64, GLUT_BITMAP_9_BY_15, "0x9600");
-    for (float i=33; i<140; i+=40) {
-        draw_text(39.0/72,i/128, GLUT_BITMAP_9_BY_15, "000");
-        draw_text(41.0/72,i/128, GLUT_BITMAP_9_BY_15, "020");
-        draw_text(43.0/72,i/128, GLUT_BITMAP_9_BY_15, "040");
-        draw_text(45.0/72,i/128, GLUT_BITMAP_9_BY_15, "060");
-        draw_text(47.0/72,i/128, GLUT_BITMAP_9_BY_15, "080");
-        draw_text(49.0/72,i/128, GLUT_BITMAP_9_BY_15, "0A0");
-        draw_text(51.0/72,i/128, GLUT_BITMAP_9_BY_15, "0C0");
-        draw_text(53.0/72,i/128, GLUT_BITMAP_9_BY_15, "0E0");
-        draw_text(55.0/72,i/128, GLUT_BITMAP_9_BY_15, "100");
-        draw_text(57.0/72,i/128, GLUT_BITMAP_9_BY_15, "120");
-        draw_text(59.0/72,i/128, GLUT_BITMAP_9_BY_15, "140");
-        draw_text(61.0/72,i/128, GLUT_BITMAP_9_BY_15, "160");
-        draw_text(63.0/72,i/128, GLUT_BITMAP_9_BY_15, "180");
-        draw_text(65.0/72,i/128, GLUT_BITMAP_9_BY_15, "1A0");
-        draw_text(67.0/72,i/128, GLUT_BITMAP_9_BY_15, "1C0");
-        draw_text(69.0/72,i/128, GLUT_BITMAP_9_BY_15, "1E0");
-    }
-    for (float i=0.5; i<50; i+=46.7) {
-        for (int j=0; j<16; j++) {
-            float ypos = 122.8 - 4*j;
-            char c[2] = {(j%8)*2 + (j%8 > 4 ? 55 : 48), 0};
-            draw_text(i/108, ypos/128, GLUT_BITMAP_HELVETICA_10, c);
-        }
-    }
-    for (float i=1.1; i<50; i+= 30) {
-        for (int j=0; j<16; j++) {
-            float xpos = i + j;
-            char c[2] = {(j%8)*2 + (j%8 > 4 ? 55 : 48), 0};
-            draw_text(xpos/108, 125.0/128, GLUT_BITMAP_HELVETICA_10, c);
-        }
+    if (debug_label_list) {
+        glCallList(debug_label_list);
+    } else { // labels are drawn with many bitmap calls, so they are recorded once and replayed
+        debug_label_list = glGenLists(1);
+        glNewList(debug_label_list, GL_COMPILE_AND_EXECUTE);
+        draw_static_labels();
+        glEndList();
     }
 
     for (int i=0; i<40; i++) {
@@ -373,35 +634,158 @@ void reshape_window_free(int w, int h) {
 }
 
 
-static void blank_screen(void) {
-    /* set the entire screen to black */
-    for (int i=0; i<SCREEN_HEIGHT; i++) {
-        for (int j=0; j<SCREEN_WIDTH; j++) {
-            texture[i][j][0]=pixvals[4][0];
-            texture[i][j][1]=pixvals[4][1];
-            texture[i][j][2]=pixvals[4][2];
+static void build_shade_tables(void) {
+    /* split pixvals into one table per colour channel for the shade conversion kernels */
+    memset(shade_tables, 0, sizeof(shade_tables));
+    for (int shade=0; shade<5; shade++) {
+        for (int c=0; c<3; c++) shade_tables[c][shade] = pixvals[shade][c];
+    }
+    shade_tables[0][SHADE_MARKER] = 255; // red
+    shade_tables_valid = 1;
+}
+
+
+static void convert_framebuffer_into(GLubyte frame[SCREEN_HEIGHT][SCREEN_WIDTH][3]) {
+    /* expand every shade in the framebuffer into an RGB frame, which is stored bottom row first */
+    if (!shade_tables_valid) build_shade_tables();
+    for (int y=0; y<SCREEN_HEIGHT; y++) {
+        convert_shade_row(framebuffer[y], frame[SCREEN_HEIGHT-1-y][0], shade_tables, SCREEN_WIDTH);
+    }
+}
+
+
+static void convert_framebuffer(void) {
+    /* expand the framebuffer into the texture shown by the main window */
+    convert_framebuffer_into(texture);
+}
+
+
+static void publish_frame(void) {
+    /* hand a finished frame to the presentation thread. The emulation thread fills the buffer it owns and
+    swaps it with the shared one, so it never waits for the display. Frames not yet shown are replaced */
+    convert_framebuffer_into(present_frames[present_write]);
+    present_write = atomic_exchange(&present_shared, present_write | FRAME_FRESH) & FRAME_INDEX_MASK;
+}
+
+
+static void build_palette_luts(void) {
+    /* fill the lookup table of shades for every palette register value */
+    for (int value=0; value<256; value++) {
+        for (int i=0; i<4; i++) {
+            palette_luts[value][i] = (value >> (2*i))&3;
         }
     }
 }
 
 
-void init_graphics(int *argc, char *argv[], char rom_title[16]) {
-    /* Main init procedure for graphics */
+static void* upscale_worker(void *arg) {
+    /* body of the upscale worker. Each frame handed to it is enlarged into the output buffer that is
+    not being shown, which then becomes the shown one, so the filter costs no emulation time */
+    static uint8_t frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+    int factor = upscale_filter_factor(upscale_filter);
+    pthread_mutex_lock(&upscale_lock);
+    while (1) {
+        while (!upscale_pending) pthread_cond_wait(&upscale_requested, &upscale_lock);
+        memcpy(frame, upscale_input, sizeof(frame));
+        upscale_pending = 0;
+        int target = !upscaled_shown;
+        pthread_mutex_unlock(&upscale_lock);
+
+        GLubyte *out = upscaled_frames[target];
+        if (upscale_filter == UPSCALE_XBR2X) {
+            xbr2x_frame(frame[0], SCREEN_WIDTH, SCREEN_HEIGHT, shade_tables, out);
+        } else {
+            int width = SCREEN_WIDTH*factor;
+            if (upscale_filter == UPSCALE_SCALE3X) {
+                scale3x_frame(frame[0], SCREEN_WIDTH, SCREEN_HEIGHT, upscaled_shades[0]);
+            } else {
+                scale2x_frame(frame[0], SCREEN_WIDTH, SCREEN_HEIGHT, upscaled_shades[0]);
+            }
+            for (int y=0; y<SCREEN_HEIGHT*factor; y++) {
+                convert_shade_row(upscaled_shades[0] + y*width, out + y*width*3, shade_tables, width);
+            }
+        }
 
-    //shared init
+        pthread_mutex_lock(&upscale_lock);
+        upscaled_shown = target;
+        upscale_ready = 1;
+        atomic_store(&upscale_fresh, 1);
+    }
+    return NULL;
+}
+
+
+static void start_upscale_worker(void) {
+    /* start the thread that enlarges finished frames with the selected filter */
+    int factor = upscale_filter_factor(upscale_filter);
+    upscaled_surface.width = SCREEN_WIDTH*factor;
+    upscaled_surface.height = SCREEN_HEIGHT*factor;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, upscale_worker, NULL)) {
+        fprintf(stderr, "Could not start the upscale thread. Frames will not be upscaled.\n");
+        upscale_filter = UPSCALE_NONE;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+
+static void submit_upscale(bool wait) {
+    /* hand the finished frame to the upscale worker. Nothing waits for the worker:
+    if it is busy, the frame replaces any that it has not started on yet. Unless wait is set,
+    the frame is dropped if the worker holds the lock at that moment */
+    if (wait) {
+        pthread_mutex_lock(&upscale_lock);
+    } else if (pthread_mutex_trylock(&upscale_lock)) {
+        return;
+    }
+    memcpy(upscale_input, framebuffer, sizeof(upscale_input));
+    upscale_pending = 1;
+    pthread_cond_signal(&upscale_requested);
+    pthread_mutex_unlock(&upscale_lock);
+}
+
+
+static bool upscaled_frame_waiting(void) {
+    /* check whether the upscale worker has finished a frame since this was last called */
+    return upscale_filter && atomic_exchange(&upscale_fresh, 0);
+}
+
+
+static void blank_screen(void) {
+    /* set the entire screen to black */
+    render_pending_lines(); // keeps the window line counter as if the lines had been drawn on time
+    memset(framebuffer, SHADE_BLANK, sizeof(framebuffer));
+    convert_framebuffer();
+    if (present_thread) publish_frame();
+    if (upscale_filter) submit_upscale(1); // otherwise gl_tick keeps drawing the worker's last lit frame
+    previous_frame_valid = 0;
+}
+
+
+static bool frame_changed(void) {
+    /* check whether the framebuffer differs from the last frame shown, and remember it if so.
+    Identical frames, such as menus and paused games, are neither converted nor redrawn */
+    if (previous_frame_valid && !memcmp(previous_framebuffer, framebuffer, sizeof(framebuffer))) return 0;
+    memcpy(previous_framebuffer, framebuffer, sizeof(framebuffer));
+    previous_frame_valid = 1;
+    return 1;
+}
+
+
+static void create_windows(int *argc, char *argv[]) {
+    /* create the main window, and the debug window if enabled, on the calling thread */
     glutInit(argc,argv);
     glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
 
     //init main window
     glutInitWindowSize(SCREEN_WIDTH*3,SCREEN_HEIGHT*3);
     glutInitWindowPosition(100,20);
-    memcpy(rom_name, rom_title, 16);
     WindowMain = glutCreateWindow(rom_name);
     glClearColor(0.0,0.0,0.0,0.0);
     glShadeModel(GL_FLAT);
     glutDisplayFunc(gl_tick);
     glutReshapeFunc(reshape_window_ratio);
-    blank_screen();
     glutKeyboardFunc(key_pressed);
     glutKeyboardUpFunc(key_released);
     glutCloseFunc(window_closed);
@@ -421,23 +805,128 @@ void init_graphics(int *argc, char *argv[], char rom_title[16]) {
         glutCloseFunc(window_closed);
     }
 
-    if (dmg_colours) memcpy(pixvals, dmgcols, 15);
-
     //start
     glutMainLoopEvent();
-    start = clock();
+}
+
+
+static void* present_loop(void *arg) {
+    /* body of the presentation thread. It owns the GL context, shows each frame published by the
+    emulation thread and forwards input to it, so the emulation thread never waits for the display */
+    create_windows(present_argc, present_argv);
+    char title[32];
+    while (1) {
+        glutMainLoopEvent();
+        bool idle = 1;
+        if (atomic_load(&present_shared) & FRAME_FRESH) {
+            present_read = atomic_exchange(&present_shared, present_read) & FRAME_INDEX_MASK;
+            displayed_frame = present_frames[present_read];
+            glutPostRedisplay();
+            idle = 0;
+        }
+        if (upscaled_frame_waiting()) {
+            glutPostRedisplay();
+            idle = 0;
+        }
+        pthread_mutex_lock(&title_lock);
+        bool set_title = title_changed;
+        if (set_title) memcpy(title, window_name, sizeof(title));
+        title_changed = 0;
+        pthread_mutex_unlock(&title_lock);
+        if (set_title) glutSetWindowTitle(title);
+        if (idle) {
+            struct timespec waittime = {0, PRESENT_IDLE_NS};
+            nanosleep(&waittime, &waittime);
+        }
+    }
+    return NULL;
+}
+
+
+static void start_present_thread(int *argc, char *argv[]) {
+    /* create the windows on a presentation thread, or on this thread if it cannot be started */
+    present_argc = argc;
+    present_argv = argv;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, present_loop, NULL)) {
+        printf("Failed to start the presentation thread, showing frames from the emulation thread\n");
+        present_thread = 0;
+        create_windows(argc, argv);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+
+void init_graphics(int *argc, char *argv[], char rom_title[16]) {
+    /* Main init procedure for graphics */
+
+    //shared init
+    init_tile_decode();
+    init_colour_convert();
+    init_scanline();
+    init_upscale();
+    memcpy(rom_name, rom_title, 16);
+    if (dmg_colours) memcpy(pixvals, dmgcols, 15);
+    build_shade_tables();
+    build_palette_luts();
+    if (render_thread) start_render_worker();
+    if (accurate_ppu) select_ppu_engine(1);
+    if (headless) { // the ppu still runs, but only draws into memory
+        blank_screen();
+        *(ram+REG_STAT) &= 0xFC; // set ppu mode to 0
+        return;
+    }
+
+    if (upscale_filter) start_upscale_worker();
+    blank_screen();
+    if (present_thread) {
+        start_present_thread(argc, argv);
+    } else {
+        create_windows(argc, argv);
+    }
+    frame_work_start = last_framerate_report = monotonic_ns();
     *(ram+REG_STAT) &= 0xFC; // set ppu mode to 0
 }
 
 
+static void queue_key_event(unsigned char key, uint16_t modifiers, uint8_t type) {
+    /* pass an input event from the presentation thread to the emulation thread. Events are dropped if the
+    queue is full, which only happens if the emulation thread has stopped reading it */
+    unsigned int written = atomic_load_explicit(&key_events_written, memory_order_relaxed);
+    if (written - atomic_load_explicit(&key_events_read, memory_order_acquire) == KEY_EVENT_QUEUE_SIZE) return;
+    key_events[written & (KEY_EVENT_QUEUE_SIZE-1)] = (KeyEvent){key, modifiers, type};
+    atomic_store_explicit(&key_events_written, written+1, memory_order_release);
+}
+
+
 void window_closed(void) {
     /* execute when the window is closed */
-    LOOP = 0;
+    if (present_thread) {
+        queue_key_event(0, 0, KEY_EVENT_CLOSE);
+    } else {
+        LOOP = 0;
+    }
+}
+
+
+uint64_t framebuffer_hash(void) {
+    /* get a 64-bit FNV-1a hash of the shades on screen, for checking output without a display */
+    render_pending_lines();
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int y=0; y<SCREEN_HEIGHT; y++) {
+        for (int x=0; x<SCREEN_WIDTH; x++) {
+            hash = (hash ^ framebuffer[y][x]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
 }
 
 
 void take_screenshot(char *filename) {
     /* take a screenshot by writing the global array 'texture' to a png */    
+    render_pending_lines();
+    convert_framebuffer();
     FILE *png_file = fopen(filename, "wb");
     if (!png_file) { // opening file failed
         return;
@@ -484,10 +973,29 @@ void take_screenshot(char *filename) {
 }
 
 
-void key_pressed(unsigned char key, int x, int y) {
+static void cycle_speed(void) {
+    /* step fast forward through normal speed, each multiplier up to MAX_SPEED_MULTIPLIER, then uncapped */
+    if (hyperspeed) {
+        hyperspeed = 0;
+        speed_multiplier = 1;
+    } else if (speed_multiplier < MAX_SPEED_MULTIPLIER) {
+        speed_multiplier *= 2;
+    } else {
+        hyperspeed = 1;
+    }
+    emulation_speed = speed_multiplier;
+    frame_deadline = 0; // pace from the next frame at the new speed
+    if (hyperspeed) {
+        fprintf(stderr, "Speed: uncapped\n");
+    } else {
+        fprintf(stderr, "Speed: %dx\n", speed_multiplier);
+    }
+}
+
+
+static void press_key(unsigned char key, uint16_t keyboard_modifiers) {
     /* handle keys being pressed */
     bool has_changed = 0;
-    uint16_t keyboard_modifiers = glutGetModifiers();
     if (keyboard_modifiers == GLUT_ACTIVE_CTRL) { // handle ctrl + <key>
         switch (key + 96) // if ctrl is pressed then it masks out 0x60
         {
@@ -539,6 +1047,10 @@ void key_pressed(unsigned char key, int x, int y) {
         case 27:
             LOOP = 0;
             break;
+        case '\t':
+            cycle_speed();
+            has_changed = 0;
+            break;
         default:
             has_changed = 0;
         }
@@ -547,7 +1059,7 @@ void key_pressed(unsigned char key, int x, int y) {
 }
 
 
-void key_released(unsigned char key, int x, int y) {
+static void release_key(unsigned char key) {
     /* handle keys being released */
     bool has_changed = 1;
     switch (key)
@@ -583,37 +1095,63 @@ void key_released(unsigned char key, int x, int y) {
 }
 
 
-static uint16_t interleave(uint16_t a, uint16_t b) {
-    /* interleave the lower 8 bits in a and b, with the bits in b coming first
-        eg: a = 0000000012345678
-            b = 00000000abcdefgh
-        becomes a1b2c3d4e5f6g7h8
-    */
-    uint16_t a1 = ((a &0x00F0)<<4) + (a &0x000F); // shift first half (000000012345678 -> 0000123400005678)
-    uint16_t a2 = ((a1&0x0C0C)<<2) + (a1&0x0303); // shift first and third pair (0000123400005678 -> 0012003400560078)
-    uint16_t a3 = ((a2&0x2222)<<1) + (a2&0x1111); // shift odd bits (0012003400560078 -> 0102030405060708)
-    
-    uint16_t b1 = ((b &0x00F0)<<4) + (b &0x000F); // as above, with b
-    uint16_t b2 = ((b1&0x0C0C)<<2) + (b1&0x0303);
-    uint16_t b3 = ((b2&0x2222)<<2) + ((b2&0x1111)<<1); // one bit further over
+void key_pressed(unsigned char key, int x, int y) {
+    /* keyboard callback for keys being pressed */
+    if (present_thread) {
+        queue_key_event(key, glutGetModifiers(), KEY_EVENT_PRESS);
+    } else {
+        press_key(key, glutGetModifiers());
+    }
+}
 
-    return a3 + b3;
+
+void key_released(unsigned char key, int x, int y) {
+    /* keyboard callback for keys being released */
+    if (present_thread) {
+        queue_key_event(key, 0, KEY_EVENT_RELEASE);
+    } else {
+        release_key(key);
+    }
 }
 
 
-static uint8_t get_tile_id(uint16_t tilepos, bool is_window_layer) {
+static void process_key_events(void) {
+    /* apply the input queued by the presentation thread, on the emulation thread */
+    unsigned int read = atomic_load_explicit(&key_events_read, memory_order_relaxed);
+    unsigned int written = atomic_load_explicit(&key_events_written, memory_order_acquire);
+    for (; read != written; read++) {
+        KeyEvent event = key_events[read & (KEY_EVENT_QUEUE_SIZE-1)];
+        switch (event.type)
+        {
+        case KEY_EVENT_PRESS:
+            press_key(event.key, event.modifiers);
+            break;
+        case KEY_EVENT_RELEASE:
+            release_key(event.key);
+            break;
+        case KEY_EVENT_CLOSE:
+            LOOP = 0;
+            break;
+        }
+    }
+    atomic_store_explicit(&key_events_read, read, memory_order_release);
+}
+
+
+static inline __attribute__((always_inline)) uint8_t get_tile_id(uint8_t lcdc, const uint8_t *vram, uint16_t tilepos, bool is_window_layer) {
+    /* read a tilemap entry from vram, which holds the contents of 0x8000-0x9FFF */
     uint16_t base_addr;
-    if ((is_window_layer && (*(ram+REG_LCDC)&64)) || ((!is_window_layer) && (*(ram+REG_LCDC)&8))) {
+    if ((is_window_layer && (lcdc&64)) || ((!is_window_layer) && (lcdc&8))) {
         base_addr = 0x9C00;
     } else {
         base_addr = 0x9800;
     }
-    return *(ram + base_addr + tilepos);
+    return vram[base_addr - 0x8000 + tilepos];
 }
 
-static uint16_t get_tile_addr(uint8_t tile_id, bool is_object) {
-    /* get the memory address of a tile from the tile id and the addressing mode register */
-    if (is_object || (*(ram+REG_LCDC)&16)) { // UNSIGNED addressing from 0x8000
+static inline __attribute__((always_inline)) uint16_t get_tile_addr(uint8_t lcdc, uint8_t tile_id, bool is_object) {
+    /* get the memory address of a tile from the tile id and the addressing mode in lcdc */
+    if (is_object || (lcdc&16)) { // UNSIGNED addressing from 0x8000
         return 0x8000 + tile_id*16;
     } else {// SIGNED addressing from 0x9000
         tile_id ^= 128;
@@ -623,173 +1161,363 @@ static uint16_t get_tile_addr(uint8_t tile_id, bool is_object) {
 }
 
 
-static void load_tile(uint16_t tile_data[8], uint16_t tile_addr) {
-    /* Read RAM to produce an 8x8 tile (stored in tile_data) */
-    
-    for (int i=0; i<8; i++) {
-        tile_data[i] = interleave(*(ram+tile_addr+(2*i)), *(ram+tile_addr+(2*i)+1));
+static void decode_tile(uint16_t tile_index) {
+    /* Read VRAM to produce an 8x8 tile of colour ids in the tile cache */
+    uint16_t tile_addr = 0x8000 + tile_index*16;
+    for (int row=0; row<8; row++) {
+        uint64_t decoded = decode_tile_row(*(ram+tile_addr+(2*row)), *(ram+tile_addr+(2*row)+1));
+        memcpy(tile_cache[tile_index][row], &decoded, 8);
     }
+    tile_cache_valid[tile_index] = 1;
+}
+
+
+static inline const uint8_t* get_tile(uint16_t tile_addr) {
+    /* get the 64 colour ids of the tile at tile_addr, decoding it only if VRAM has changed */
+    uint16_t tile_index = (tile_addr-0x8000)>>4;
+    if (!tile_cache_valid[tile_index]) decode_tile(tile_index);
+    return &tile_cache[tile_index][0][0];
+}
+
+
+void invalidate_tile(uint16_t addr) {
+    /* mark the cached tile containing a VRAM address as stale. Called on every write to 0x8000-0x97FF */
+    tile_cache_valid[(addr-0x8000)>>4] = 0;
 }
 
 
-static inline void read_objects(void) {
-    /* builds an array of up to 10 object attributes that intersect with the current scanline */
-    objects_found = 0;
-    uint8_t offset_scanline = *(ram+REG_LY) + 16;
-    bool tile8x16 = *(ram+REG_LCDC) & 4; //1 if 8x8, 0 if 8x16
+static void build_oam_index(void) {
+    /* decode OAM into oam_shadow and bucket the first 10 objects that intersect each scanline */
+    bool tile8x16 = *(ram+REG_LCDC) & 4;
+    uint8_t height = tile8x16 ? 16 : 8;
+    memset(line_object_count, 0, sizeof(line_object_count));
     for (int i=0; i<40; i++) {
-        if (objects_found == 10) break;
-        uint8_t ypos = *(ram+0xFE00+(i*4));
-        if (
-            (!(tile8x16) && ypos<=offset_scanline && ypos+8>offset_scanline) || 
-            (tile8x16 && ypos<=offset_scanline  && ypos+16>offset_scanline)
-        ) { //Object intersects scanline
-            uint8_t flags = *(ram+0xFE00+(i*4)+3);
-            objects[objects_found] = (ObjectAttribute){
-                .ypos = ypos,
-                .xpos = *(ram+0xFE00+(i*4)+1),
-                .tileid = *(ram+0xFE00+(i*4)+2),
-                .priority = (bool)(flags & (1<<7)),
-                .yflip = (bool)(flags & (1<<6)),
-                .xflip = (bool)(flags & (1<<5)),
-                .palette = (bool)(flags & (1<<4))
-            };
-            debug_used_objects[i] = 1;
-            objects_found++;
+        uint8_t flags = *(ram+0xFE00+(i*4)+3);
+        oam_shadow[i] = (ObjectAttribute){
+            .ypos = *(ram+0xFE00+(i*4)),
+            .xpos = *(ram+0xFE00+(i*4)+1),
+            .tileid = *(ram+0xFE00+(i*4)+2),
+            .priority = (bool)(flags & (1<<7)),
+            .yflip = (bool)(flags & (1<<6)),
+            .xflip = (bool)(flags & (1<<5)),
+            .palette = (bool)(flags & (1<<4))
+        };
+        int first_line = oam_shadow[i].ypos - 16;
+        for (int line = first_line < 0 ? 0 : first_line; line < first_line+height && line < SCREEN_HEIGHT; line++) {
+            if (line_object_count[line] < 10) line_objects[line][line_object_count[line]++] = i;
         }
     }
+    oam_index_valid = 1;
+    oam_index_tall = tile8x16;
+}
+
+
+void invalidate_oam(void) {
+    /* mark the per-scanline object index as stale. Called on every write to OAM, including by DMA */
+    oam_index_valid = 0;
+}
+
+
+static inline void read_objects(uint8_t ly) {
+    /* builds an array of up to 10 object attributes that intersect with a scanline, sorted by xpos */
+    if (!oam_index_valid || oam_index_tall != (bool)(*(ram+REG_LCDC) & 4)) build_oam_index();
+    ObjectAttribute *objects = scanned_objects[ly];
+    scanned_object_count[ly] = line_object_count[ly];
+    for (int i=0; i<scanned_object_count[ly]; i++) {
+        ObjectAttribute object = oam_shadow[line_objects[ly][i]];
+        debug_used_objects[line_objects[ly][i]] = 1;
+
+        // insertion sort by xpos. Objects arrive in OAM order, which breaks ties
+        int j = i;
+        for (; j > 0 && objects[j-1].xpos > object.xpos; j--) {
+            objects[j] = objects[j-1];
+        }
+        objects[j] = object;
+    }
+}
+
+
+static inline const uint8_t* get_palette_lut(uint8_t palette) {
+    /* get the shade of each colour id in a palette register value */
+    return palette_luts[palette];
 }
 
 
 static uint8_t get_background_palette(uint8_t palette_value) {
-    /* poll the BGP register */
-    return (*(ram+REG_BGP) >> (2*palette_value))&3;
+    /* get the shade of a colour id in BGP */
+    return get_palette_lut(*(ram+REG_BGP))[palette_value];
 }
 
 
 static uint8_t get_object_palette(bool palette_id, uint8_t palette_value) {
-    /* poll the BGP register */
-    if (palette_id) {
-        return (*(ram+REG_OBP1) >> (2*palette_value))&3;
+    /* get the shade of a colour id in OBP0 or OBP1 */
+    return get_palette_lut(*(ram+REG_OBP0+palette_id))[palette_value];
+}
+
+
+static inline void copy_tile_row(const TileSource *source, uint16_t tile_addr, uint8_t row, uint8_t out[8]) {
+    /* copy one row of colour ids from a tile. Only the emulation thread may use the tile cache,
+    so the render worker decodes rows straight from the VRAM it was given */
+    if (source->use_tile_cache) {
+        memcpy(out, get_tile(tile_addr) + row*8, 8);
+    } else {
+        const uint8_t *data = source->vram + (tile_addr-0x8000) + 2*row;
+        uint64_t decoded = decode_tile_row(data[0], data[1]);
+        memcpy(out, &decoded, 8);
     }
-    return (*(ram+REG_OBP0) >> (2*palette_value))&3;
 }
 
 
-static inline int compare_obj_xvalue(const void *a, const void *b) {
-    /* compare to ObjectAttributes by xpos, for sorting */
-    ObjectAttribute *objA = (ObjectAttribute *)a;
-    ObjectAttribute *objB = (ObjectAttribute *)b;
-  
-    return ((int)objA->xpos) - ((int)objB->xpos);
+static inline __attribute__((always_inline)) void fetch_tile_rows(uint8_t lcdc, const TileSource *source, uint8_t line[21*8], uint16_t map_row, uint8_t first_column, uint8_t tile_row, bool is_window_layer) {
+    /* copy one pre-decoded row from each of 21 consecutive tiles along a tilemap row */
+    for (uint8_t i=0; i<21; i++) {
+        uint8_t tile_id = get_tile_id(lcdc, source->vram, map_row*32 + ((first_column+i)%32), is_window_layer);
+        copy_tile_row(source, get_tile_addr(lcdc, tile_id, 0), tile_row, line + i*8);
+    }
 }
 
 
-static inline void draw_background() {
-    /* Draw the background layer on the current scanline */
-    if ((*(ram+REG_LCDC)&1) == 0) { //bg is disabled
-        for (int i=0; i<SCREEN_WIDTH; i++) {
-            texture[143-*(ram+REG_LY)][i][0] = pixvals[0][0];
-            texture[143-*(ram+REG_LY)][i][1] = pixvals[0][1];
-            texture[143-*(ram+REG_LY)][i][2] = pixvals[0][2];
-        }
+static inline bool window_visible(uint8_t ly, const LineState *state) {
+    /* check if the window is drawn on a scanline. The window's line counter only advances when it is */
+    return (state->lcdc&1) && (state->lcdc&0x20) && ly >= state->wx && state->wy - 7 < SCREEN_WIDTH; // bg and window enabled, and scanline >= window Y
+}
+
+
+static inline __attribute__((always_inline)) void draw_background_and_window(uint8_t ly, const LineState *state, const TileSource *source) {
+    /* Draw the background and window layers on a scanline. Both layers are
+    assembled as colour ids from whole tile rows, then mapped through BGP in one pass */
+    if ((state->lcdc&1) == 0) { //bg is disabled
+        memset(framebuffer[ly], 0, SCREEN_WIDTH);
         return;
     }
-    uint8_t top = *(ram+REG_LY) + *(ram+REG_SCY); //get scroll vals
-    uint8_t left = *(ram+REG_SCX);
-    uint16_t tiles[21][8];
-    for (uint8_t i=0; i<21; i++) {
-        uint8_t tile_id = get_tile_id((((left>>3)+i)%32) + (top>>3)*32, 0);
-        load_tile(tiles[i], get_tile_addr(tile_id, 0));
+    uint8_t fetched[21*8];
+    uint8_t background[SCREEN_WIDTH];
+    uint8_t line[SCREEN_WIDTH];
+
+    uint8_t top = ly + state->scy; //get scroll vals
+    uint8_t left = state->scx;
+    fetch_tile_rows(state->lcdc, source, fetched, top>>3, left>>3, top%8, 0);
+    memcpy(background, fetched + left%8, SCREEN_WIDTH); // fine scroll
+    memcpy(line, background, SCREEN_WIDTH);
+
+    if (window_visible(ly, state)) {
+        int window_start = state->wy - 7; // screen x of the first window pixel
+        fetch_tile_rows(state->lcdc, source, fetched, state->window_line>>3, 0, state->window_line%8, 1);
+        uint8_t clipped = window_start < 0 ? -window_start : 0;
+        if (window_start < 0) window_start = 0;
+        memcpy(line + window_start, fetched + clipped, SCREEN_WIDTH - window_start);
     }
 
-    for (uint8_t i=0; i<SCREEN_WIDTH; i++) {
-        uint8_t pix = (tiles[((i+left%8))>>3][top%8] >> (14-(2*(((i+left)%8)))))&3;
-        bgw_priority_map[143-*(ram+REG_LY)][i] = (bool)pix;
-        texture[143-*(ram+REG_LY)][i][0] = pixvals[get_background_palette(pix)][0];
-        texture[143-*(ram+REG_LY)][i][1] = pixvals[get_background_palette(pix)][1];
-        texture[143-*(ram+REG_LY)][i][2] = pixvals[get_background_palette(pix)][2];
-    }
+    map_bgw_row(line, background, get_palette_lut(state->bgp), framebuffer[ly], (uint8_t*)bgw_priority_map[ly], SCREEN_WIDTH);
 }
 
 
-static inline void draw_window() {
-    /* Draw the window layer on the current scanline */
-    if ((*(ram+REG_LCDC)&0x21) == 0x21) { // Window Enable and BG/Window Enable bits are set
-        if (*(ram+REG_LY) >= *(ram+REG_WX)) { // when scanline >= window Y
-            bool pixel_drawn = 0;
-            uint16_t tiles[21][8];
-            for (int i=0; i<21; i++) {
-                uint8_t tile_id = get_tile_id(i + (window_internal_counter>>3)*32, 1);
-                load_tile(tiles[i], get_tile_addr(tile_id, 0));
+static inline __attribute__((always_inline)) void draw_objects(uint8_t ly, const LineState *state, const TileSource *source) {
+    /* Draw the object layer on a scanline. Objects are sorted by xpos, so the first object to
+    place an opaque, unhidden pixel in the sprite line buffer takes priority over the ones after it */
+    uint8_t objects_found = scanned_object_count[ly];
+    if (!((state->lcdc&2) && objects_found)) return; // draw objects if object layer is enabled and the scanline contains at least one object
+    const ObjectAttribute *objects = scanned_objects[ly];
+    bool tile8x16 = state->lcdc&4;
+    uint8_t height_mask = tile8x16 ? 15 : 7;
+    // the sprite line buffer is offset by 8 pixels so objects partially off the left edge need no clipping
+    uint8_t sprite_line[SCREEN_WIDTH+16];
+    uint8_t sprite_mask[SCREEN_WIDTH+16] = {0};
+    const bool *bg_priority = bgw_priority_map[ly];
+
+    for (int i=0; i<objects_found; i++) {
+        ObjectAttribute object = objects[i];
+        if (object.xpos == 0 || object.xpos >= SCREEN_WIDTH+8) continue; // entirely off screen
+        uint8_t sprite_y = (ly - (object.ypos-16)) & height_mask;
+        if (object.yflip) sprite_y = height_mask - sprite_y;
+        uint8_t tileid = object.tileid;
+        if (tile8x16) tileid = (tileid&0xFE) | (sprite_y>>3); // top tile has the lower bit reset, bottom tile has it set
+
+        uint64_t row;
+        uint8_t row_ids[8];
+        copy_tile_row(source, get_tile_addr(state->lcdc, tileid, 1), sprite_y&7, row_ids);
+        memcpy(&row, row_ids, 8);
+        if (object.xflip) row = __builtin_bswap64(row); // one colour id per byte, so reversing the bytes mirrors the row
+        uint8_t pixels[8];
+        memcpy(pixels, &row, 8);
+
+        const uint8_t *palette = get_palette_lut(object.palette ? state->obp1 : state->obp0);
+        int first = object.xpos < 8 ? 8-object.xpos : 0;
+        int last = object.xpos > SCREEN_WIDTH ? SCREEN_WIDTH+8-object.xpos : 8;
+        for (int k=first; k<last; k++) {
+            uint8_t pos = object.xpos + k; // buffer position, screen x + 8
+            if (pixels[k] && !sprite_mask[pos] && !(object.priority & bg_priority[pos-8])) { // skip if transparent, already claimed or background has priority
+                sprite_line[pos] = palette[pixels[k]];
+                sprite_mask[pos] = 0xFF;
             }
-            for (int screen_x_pos = *(ram+REG_WY) - 7; screen_x_pos < SCREEN_WIDTH; screen_x_pos++) {
-                pixel_drawn = 1;
-                uint8_t window_x_pos = screen_x_pos - (*(ram+REG_WY) - 7);
-                //screen_y_pos is *(ram+REG_LY)
-                //window_y_pos is window_internal_counter
-
-
-                //draw pixel at (window_x_pos, window_y_pos) to (screen_x_pos, screen_y_pos)
-                uint8_t pix = (tiles[window_x_pos>>3][window_internal_counter%8] >> (14-(2*((window_x_pos%8)))))&3;
-                bgw_priority_map[143-*(ram+REG_LY)][screen_x_pos] |= (bool)pix;
-                texture[143-*(ram+REG_LY)][screen_x_pos][0] = pixvals[get_background_palette(pix)][0];
-                texture[143-*(ram+REG_LY)][screen_x_pos][1] = pixvals[get_background_palette(pix)][1];
-                texture[143-*(ram+REG_LY)][screen_x_pos][2] = pixvals[get_background_palette(pix)][2];
-            }
-            if (pixel_drawn) window_internal_counter++;
         }
     }
+    blend_object_row(sprite_line+8, sprite_mask+8, framebuffer[ly], SCREEN_WIDTH);
 }
 
 
-static inline void draw_objects(void) {
-    /* Draw the object layer on the current scanline. Assumes objects are sorted by xpos, largest first */
-    if (((*(ram+REG_LCDC))&2) && objects_found) { // draw objects if object layer is enabled and the current scanline contains at least one object
-        uint16_t tiles[20][8];
-        for (int8_t i = objects_found-1; i >= 0; i--) {
-            if ((*(ram+REG_LCDC))&4) { // object 8x16 mode
-                load_tile(tiles[2*i], get_tile_addr(objects[i].tileid&0xFE, 1)); // &0xFE force-resets lower bit
-                load_tile(tiles[2*i+1], get_tile_addr(objects[i].tileid|0x01, 1)); // |0x01 force-sets lower bit
-            } else {
-                load_tile(tiles[i], get_tile_addr(objects[i].tileid, 1));
-            }
-            for (int16_t screen_x = objects[i].xpos-8; screen_x<objects[i].xpos; screen_x++) {
-                if (screen_x >= 0 && screen_x < SCREEN_WIDTH) {
-                    ObjectAttribute target_object = objects[i];
-                    uint8_t sprite_x = screen_x - (target_object.xpos-8);
-                    if (!target_object.xflip) sprite_x = 7 - sprite_x;
-                    uint8_t sprite_y = *(ram+REG_LY) - (target_object.ypos-16);
-                    if (target_object.yflip && !((*(ram+REG_LCDC))&4)) sprite_y = 7 - sprite_y;
-                    if (target_object.yflip && ((*(ram+REG_LCDC))&4)) sprite_y = 15 - sprite_y;
-                    uint16_t tile_line;
-                    if (!((*(ram+REG_LCDC))&4)) { // object 8x8 mode
-                        tile_line = tiles[i][sprite_y];
-                    } else { // object 8x16 mode
-                        if (sprite_y < 8) {
-                            tile_line = tiles[2*i][sprite_y];
-                        } else {
-                            tile_line = tiles[2*i + 1][sprite_y-8];
-                        }
-                    }
-                    uint8_t pixel = (tile_line>>(2*sprite_x))&3;
-                    if (pixel && !(target_object.priority & bgw_priority_map[143-*(ram+REG_LY)][screen_x])) { // skip if transparent and background does not have priority
-                        texture[143-*(ram+REG_LY)][screen_x][0] = pixvals[get_object_palette(target_object.palette, (tile_line>>(2*sprite_x))&3)][0];
-                        texture[143-*(ram+REG_LY)][screen_x][1] = pixvals[get_object_palette(target_object.palette, (tile_line>>(2*sprite_x))&3)][1];
-                        texture[143-*(ram+REG_LY)][screen_x][2] = pixvals[get_object_palette(target_object.palette, (tile_line>>(2*sprite_x))&3)][2];
-                    }
-                }
-            }
+static inline __attribute__((always_inline)) void draw_specialised_line(uint8_t ly, const TileSource *source, uint8_t key_lcdc) {
+    /* draw a scanline with the LCDC bits in LCDC_KEY_BITS replaced by key_lcdc. Each renderer
+    passes a constant key, so the tile addressing, map and object size tests fold away */
+    LineState state = line_states[ly];
+    state.lcdc = (state.lcdc & ~LCDC_KEY_BITS) | key_lcdc;
+    draw_background_and_window(ly, &state, source);
+    draw_objects(ly, &state, source);
+}
+
+
+#define DEFINE_LINE_RENDERER(key) \
+    static void draw_line_##key(uint8_t ly, const TileSource *source) { \
+        draw_specialised_line(ly, source, LCDC_FROM_KEY(key)); \
+    }
+DEFINE_LINE_RENDERER(0) DEFINE_LINE_RENDERER(1) DEFINE_LINE_RENDERER(2) DEFINE_LINE_RENDERER(3)
+DEFINE_LINE_RENDERER(4) DEFINE_LINE_RENDERER(5) DEFINE_LINE_RENDERER(6) DEFINE_LINE_RENDERER(7)
+DEFINE_LINE_RENDERER(8) DEFINE_LINE_RENDERER(9) DEFINE_LINE_RENDERER(10) DEFINE_LINE_RENDERER(11)
+DEFINE_LINE_RENDERER(12) DEFINE_LINE_RENDERER(13) DEFINE_LINE_RENDERER(14) DEFINE_LINE_RENDERER(15)
+
+static void (*const line_renderers[16])(uint8_t ly, const TileSource *source) = {
+    draw_line_0, draw_line_1, draw_line_2, draw_line_3, draw_line_4, draw_line_5, draw_line_6, draw_line_7,
+    draw_line_8, draw_line_9, draw_line_10, draw_line_11, draw_line_12, draw_line_13, draw_line_14, draw_line_15
+};
+
+
+static void draw_line(uint8_t ly, const TileSource *source) {
+    /* draw a recorded scanline from its latched registers, with the renderer specialised for its LCDC */
+    line_renderers[KEY_FROM_LCDC(line_states[ly].lcdc)](ly, source);
+}
+
+
+static void* render_worker(void *arg) {
+    /* draw submitted scanlines in the order they were recorded, for as long as the emulator runs */
+    pthread_mutex_lock(&render_lock);
+    while (1) {
+        while (drawn_line_count >= submitted_line_count) pthread_cond_wait(&lines_submitted, &render_lock);
+        uint8_t ly = pending_lines[drawn_line_count];
+        TileSource source = {.vram = line_vram[ly], .use_tile_cache = 0};
+        worker_vram = source.vram;
+        pthread_mutex_unlock(&render_lock);
+
+        draw_line(ly, &source);
+
+        pthread_mutex_lock(&render_lock);
+        for (int i=0; i<VRAM_SNAPSHOTS; i++) {
+            if (source.vram == vram_snapshots[i]) snapshot_users[i]--;
         }
+        worker_vram = NULL;
+        drawn_line_count++;
+        pthread_cond_broadcast(&lines_drawn);
     }
+    return NULL;
 }
 
 
-static void debug_draw_background_tile(uint16_t tile[8], GLubyte tex_array[256][256][3], uint8_t base_x, uint8_t base_y) {
+static void start_render_worker(void) {
+    /* start the thread that draws recorded scanlines while the emulation thread runs ahead */
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, render_worker, NULL)) {
+        fprintf(stderr, "Could not start the render thread. Drawing on the emulation thread instead.\n");
+        render_thread = 0;
+        return;
+    }
+    pthread_detach(worker);
+}
+
+
+static void submit_lines(void) {
+    /* let the render worker draw every line recorded so far */
+    pthread_mutex_lock(&render_lock);
+    submitted_line_count = pending_line_count;
+    pthread_cond_signal(&lines_submitted);
+    pthread_mutex_unlock(&render_lock);
+}
+
+
+static inline LineState latch_line_state(void) {
+    /* copy the registers that affect drawing a scanline */
+    return (LineState){
+        .lcdc = *(ram+REG_LCDC),
+        .scx = *(ram+REG_SCX),
+        .scy = *(ram+REG_SCY),
+        .wx = *(ram+REG_WX),
+        .wy = *(ram+REG_WY),
+        .bgp = *(ram+REG_BGP),
+        .obp0 = *(ram+REG_OBP0),
+        .obp1 = *(ram+REG_OBP1),
+        .window_line = window_internal_counter
+    };
+}
+
+
+static inline void record_line(uint8_t ly) {
+    /* latch the registers that affect drawing as a scanline enters mode 3. The line is drawn later */
+    line_states[ly] = latch_line_state();
+    if (window_visible(ly, &line_states[ly])) window_internal_counter++;
+    pending_lines[pending_line_count++] = ly;
+    if (render_thread) {
+        line_vram[ly] = ram+0x8000;
+        live_vram_in_use = 1;
+        if (pending_line_count % LINES_PER_SUBMIT == 0) submit_lines();
+    }
+}
+
+
+void render_pending_lines(void) {
+    /* draw every recorded scanline, or wait for the render worker to finish drawing them.
+    Called at VBlank, and before anything reads or replaces the framebuffer */
+    if (!pending_line_count) return;
+    if (!render_thread) {
+        TileSource source = {.vram = ram+0x8000, .use_tile_cache = 1};
+        for (int i=0; i<pending_line_count; i++) {
+            draw_line(pending_lines[i], &source);
+        }
+        pending_line_count = 0;
+        return;
+    }
+    pthread_mutex_lock(&render_lock);
+    submitted_line_count = pending_line_count;
+    pthread_cond_signal(&lines_submitted);
+    while (drawn_line_count < submitted_line_count) pthread_cond_wait(&lines_drawn, &render_lock);
+    pending_line_count = submitted_line_count = drawn_line_count = 0;
+    live_vram_in_use = 0;
+    pthread_mutex_unlock(&render_lock);
+}
+
+
+void prepare_vram_write(void) {
+    /* called before every write to VRAM. Undrawn lines that were recorded against the current
+    contents are drawn now, or when drawing on the render worker, moved onto a snapshot of VRAM */
+    if (!render_thread) {
+        render_pending_lines();
+        return;
+    }
+    if (!live_vram_in_use) return;
+
+    pthread_mutex_lock(&render_lock);
+    while (worker_vram == ram+0x8000) pthread_cond_wait(&lines_drawn, &render_lock); // let the worker finish a line it is reading from live VRAM
+    int snapshot = 0;
+    while (snapshot < VRAM_SNAPSHOTS && snapshot_users[snapshot]) snapshot++;
+    if (snapshot == VRAM_SNAPSHOTS) { // every snapshot is still needed, so wait for the worker to catch up instead
+        pthread_mutex_unlock(&render_lock);
+        render_pending_lines();
+        return;
+    }
+    memcpy(vram_snapshots[snapshot], ram+0x8000, 0x2000);
+    for (int i=drawn_line_count; i<pending_line_count; i++) {
+        if (line_vram[pending_lines[i]] == ram+0x8000) {
+            line_vram[pending_lines[i]] = vram_snapshots[snapshot];
+            snapshot_users[snapshot]++;
+        }
+    }
+    live_vram_in_use = 0;
+    pthread_mutex_unlock(&render_lock);
+}
+
+
+static void debug_draw_background_tile(const uint8_t *tile, GLubyte tex_array[256][256][3], uint8_t base_x, uint8_t base_y) {
     /* draw a tile at a particular coordinate */
     for (int v=0; v<8; v++) {
         for (int u=0; u<8; u++) {
-            uint8_t pix = (tile[u] >> (14-2*v))&3;
+            uint8_t pix = tile[u*8+v];
             tex_array[255-(base_y*8+u)][base_x*8+v][0] = pixvals[get_background_palette(pix)][0];
             tex_array[255-(base_y*8+u)][base_x*8+v][1] = pixvals[get_background_palette(pix)][1];
             tex_array[255-(base_y*8+u)][base_x*8+v][2] = pixvals[get_background_palette(pix)][2];
@@ -798,15 +1526,15 @@ static void debug_draw_background_tile(uint16_t tile[8], GLubyte tex_array[256][
 }
 
 
-static void debug_draw_sprite_tile(uint16_t tile[8], uint8_t base_x, uint8_t base_y, ObjectAttribute object) {
+static void debug_draw_sprite_tile(const uint8_t *tile, uint8_t base_x, uint8_t base_y, ObjectAttribute object) {
     /* draw a tile at a particular coordinate */
     for (int v=0; v<8; v++) {
         for (int u=0; u<8; u++) {
             uint8_t pix;
             if (object.xflip) {
-                pix = (tile[u] >> (2*v))&3;
+                pix = tile[u*8+7-v];
             } else {
-                pix = (tile[u] >> (14-2*v))&3;
+                pix = tile[u*8+v];
             }
             uint8_t ypos;
             if (object.yflip) {
@@ -822,18 +1550,28 @@ static void debug_draw_sprite_tile(uint16_t tile[8], uint8_t base_x, uint8_t bas
 }
 
 
-static void debug_tilemaps(void) {
-    /* draw the background and window tilespaces on the debug window */
+static inline bool debug_map_entry_changed(uint8_t lcdc, uint16_t tilepos, bool is_window_layer, const bool tile_changed[384]) {
+    /* check whether a tilemap entry, or the tile it refers to, changed since the debug views were last drawn */
+    uint16_t map_offset = ((lcdc >> (is_window_layer ? 6 : 3)) & 1 ? 0x1C00 : 0x1800) + tilepos;
+    uint16_t tile_addr = get_tile_addr(lcdc, get_tile_id(lcdc, ram+0x8000, tilepos, is_window_layer), 0);
+    return tile_changed[(tile_addr-0x8000)>>4] || *(ram+0x8000+map_offset) != debug_vram_shadow[map_offset];
+}
+
+
+static void debug_tilemaps(const bool tile_changed[384]) {
+    /* draw the background and window tilespaces on the debug window, redrawing only the changed entries */
+    uint8_t lcdc = *(ram+REG_LCDC);
     for (int y=0; y<32; y++) {
         for (int x=0; x<32; x++) {
-            uint16_t tile[8];
-            load_tile(tile, get_tile_addr(get_tile_id(y*32+x, 0), 0));
-            debug_draw_background_tile(tile, bg_tilemap, x, y);
-
-            load_tile(tile, get_tile_addr(get_tile_id(y*32+x, 1), 0));
-            debug_draw_background_tile(tile, window_tilemap, x, y);
+            if (debug_map_entry_changed(lcdc, y*32+x, 0, tile_changed)) {
+                debug_draw_background_tile(get_tile(get_tile_addr(lcdc, get_tile_id(lcdc, ram+0x8000, y*32+x, 0), 0)), bg_tilemap_tiles, x, y);
+            }
+            if (debug_map_entry_changed(lcdc, y*32+x, 1, tile_changed)) {
+                debug_draw_background_tile(get_tile(get_tile_addr(lcdc, get_tile_id(lcdc, ram+0x8000, y*32+x, 1), 0)), window_tilemap, x, y);
+            }
         }
     }
+    memcpy(bg_tilemap, bg_tilemap_tiles, sizeof(bg_tilemap)); // the viewport is drawn over a copy, so it leaves no trail
     uint8_t bg_scanline = *(ram+REG_LY) + *(ram+REG_SCY);
 
     for (int x=0; x<161; x++) {
@@ -862,11 +1600,15 @@ static void debug_tilemaps(void) {
 }
 
 
-static void debug_sprites(void) {
-    /* Debug util to display each sprite */
+static void debug_sprites(const bool tile_changed[384], bool redraw_all) {
+    /* Debug util to display each sprite, redrawing only objects whose attributes or tiles changed */
 
-    uint16_t blank[8] = {0,0,0,0,0,0,0,0};
+    static const uint8_t blank[64] = {0};
+    bool tall = *(ram+REG_LCDC)&4;
     for (int i=0; i<40; i++) {
+        uint8_t tile_id = *(ram+0xFE00+(i*4)+2);
+        if (!redraw_all && !memcmp(ram+0xFE00+i*4, debug_oam_shadow+i*4, 4)
+            && !tile_changed[tile_id] && !(tall && tile_changed[(uint8_t)(tile_id+1)])) continue;
         uint8_t flags = *(ram+0xFE00+(i*4)+3);
         ObjectAttribute object = (ObjectAttribute) {
             .ypos = *(ram+0xFE00+(i*4)),
@@ -877,12 +1619,9 @@ static void debug_sprites(void) {
             .xflip = flags & (1<<5),
             .palette = flags & (1<<4)
         };
-        uint16_t sprite[8];
-        load_tile(sprite, get_tile_addr(object.tileid, 1));
-        debug_draw_sprite_tile(sprite, i, object.yflip, object);
+        debug_draw_sprite_tile(get_tile(get_tile_addr(*(ram+REG_LCDC), object.tileid, 1)), i, object.yflip, object);
         if (*(ram+REG_LCDC)&4) { // 8x16 sprites
-            load_tile(sprite, get_tile_addr(object.tileid+1, 1));
-            debug_draw_sprite_tile(sprite, i, !object.yflip, object);
+            debug_draw_sprite_tile(get_tile(get_tile_addr(*(ram+REG_LCDC), object.tileid+1, 1)), i, !object.yflip, object);
         } else {
             debug_draw_sprite_tile(blank, i, !object.yflip, object);
         }
@@ -892,23 +1631,21 @@ static void debug_sprites(void) {
 static void debug_tile_boundaries(void) {
     for (uint8_t x=0; x<SCREEN_WIDTH; x++) {
         if (!((*(ram + REG_LY) | x)&7)) {
-            texture[143-*(ram + REG_LY)][x][0] = 255;
-            texture[143-*(ram + REG_LY)][x][1] = 0;
-            texture[143-*(ram + REG_LY)][x][2] = 0;
+            framebuffer[*(ram + REG_LY)][x] = SHADE_MARKER;
         }
     }
 }
 
 
-static void debug_vram(GLubyte block[32][256][3], uint16_t starting_addr) {
-    /* draw vram for debugging */
+static void debug_vram(GLubyte block[32][256][3], uint16_t starting_addr, const bool tile_changed[384]) {
+    /* draw vram for debugging, redrawing only the changed tiles */
     for (uint8_t i=0; i<4; i++) {
         for (uint8_t j=0; j<32; j++) {
-            uint16_t tile[8];
-            load_tile(tile, starting_addr + (i*32+j)*16);
+            if (!tile_changed[((starting_addr-0x8000)>>4) + i*32+j]) continue;
+            const uint8_t *tile = get_tile(starting_addr + (i*32+j)*16);
             for (int v=0; v<8; v++) {
                 for (int u=0; u<8; u++) {
-                    uint8_t pix = (tile[v] >> (14-2*u))&3;
+                    uint8_t pix = tile[v*8+u];
                     block[31-(i*8+v)][j*8+u][0] = pixvals[get_background_palette(pix)][0];
                     block[31-(i*8+v)][j*8+u][1] = pixvals[get_background_palette(pix)][1];
                     block[31-(i*8+v)][j*8+u][2] = pixvals[get_background_palette(pix)][2];
@@ -919,9 +1656,156 @@ static void debug_vram(GLubyte block[32][256][3], uint16_t starting_addr) {
 }
 
 
-bool tick_graphics(void) {
-    /* Main tick procedure for graphics */
+static void refresh_debug_views(void) {
+    /* bring the tilemap, object and VRAM views up to date. Only tiles whose VRAM bytes or map entries
+    changed since the last refresh are redrawn, unless LCDC or a palette changed, which affect them all */
+    uint8_t registers[4] = {*(ram+REG_LCDC), *(ram+REG_BGP), *(ram+REG_OBP0), *(ram+REG_OBP1)};
+    bool redraw_all = !debug_views_valid || memcmp(registers, debug_view_registers, 2);
+    bool redraw_objects = redraw_all || memcmp(registers+2, debug_view_registers+2, 2);
+    bool tile_changed[384];
+    for (int i=0; i<384; i++) {
+        tile_changed[i] = redraw_all || memcmp(ram+0x8000+i*16, debug_vram_shadow+i*16, 16);
+    }
+    debug_tilemaps(tile_changed);
+    debug_sprites(tile_changed, redraw_objects);
+    debug_vram(vram_block_1, 0x8000, tile_changed);
+    debug_vram(vram_block_2, 0x8800, tile_changed);
+    debug_vram(vram_block_3, 0x9000, tile_changed);
+
+    memcpy(debug_vram_shadow, ram+0x8000, sizeof(debug_vram_shadow));
+    memcpy(debug_oam_shadow, ram+0xFE00, sizeof(debug_oam_shadow));
+    memcpy(debug_view_registers, registers, sizeof(registers));
+    debug_views_valid = 1;
+}
+
+
+static uint32_t find_next_event(uint32_t from) {
+    /* get the first dot at or after from where a scanline starts or the ppu changes mode */
+    uint32_t line_start = from - (from % DOTS_PER_LINE);
+    uint32_t position = from % DOTS_PER_LINE;
+    if (position == 0) return from;
+    if (line_start < SCREEN_HEIGHT*DOTS_PER_LINE) {
+        if (position <= 80) return line_start + 80;
+        if (position <= 232) return line_start + 232;
+        if (line_start + DOTS_PER_LINE > VBLANK_DOT && from <= VBLANK_DOT) return VBLANK_DOT;
+    }
+    line_start += DOTS_PER_LINE;
+    return line_start == DOTS_PER_FRAME ? 0 : line_start;
+}
+
+
+void ppu_register_written(void) {
+    /* LCDC, STAT or LYC changed, so LY=LYC, the STAT interrupt line and the LCD state are evaluated on the next tick */
+    next_event_dot = dot;
+}
+
+
+static uint16_t mode3_length(uint8_t ly) {
+    /* approximate the length of mode 3 from its documented penalties: discarding pixels for the fine
+    background scroll, restarting the fetcher for the window, and pausing it to fetch each object */
+    LineState state = latch_line_state();
+    uint16_t length = MIN_MODE3_LENGTH + (state.scx&7);
+    if (window_visible(ly, &state)) length += 6;
+    if (state.lcdc&2) {
+        for (int i=0; i<scanned_object_count[ly]; i++) {
+            uint8_t xpos = scanned_objects[ly][i].xpos;
+            if (xpos >= SCREEN_WIDTH+8) continue; // never reached by the fetcher
+            uint8_t offset = (xpos + state.scx)&7;
+            length += 6 + (offset < 5 ? 5-offset : 0);
+        }
+    }
+    return length;
+}
+
+
+static void enter_vblank(void) {
+    /* finish the frame: show it, update the debug views and wait for the next frame time */
+    render_pending_lines();
+    lag_frame = !joypad_polled;
+    joypad_polled = 0;
+    lag_frames += lag_frame;
+    vblanks++;
+    if (frame_hidden) { // only the emulated state matters
+        window_internal_counter = 0;
+        return;
+    }
+    if (export_debug) export_debug_state(ram, framebuffer, window_internal_counter, lag_frames);
+    xoffset++;
+    if (xoffset == SCREEN_HEIGHT) xoffset = 0;
+    window_internal_counter = 0;
+    lag_run = lag_frame ? lag_run + 1 : 0;
+    bool hide_lag = skip_lag_frames && lag_frame && lag_run <= MAX_HIDDEN_LAG_FRAMES; // the game is still working on the last frame, so this one may be half drawn
+    if (present_thread) {
+        if (!skip_frame && !hide_lag && frame_changed()) {
+            publish_frame();
+            if (upscale_filter) submit_upscale(0);
+        }
+        process_key_events();
+    } else if (!headless) {
+        bool show_frame = !skip_frame && !hide_lag && frame_changed();
+        if (show_frame) convert_framebuffer();
+        if (show_frame && upscale_filter) submit_upscale(0);
+        glutMainLoopEvent();
+        if (show_frame || upscaled_frame_waiting()) glutPostRedisplay();
+    }
+    if (debug_tilemap && !skip_frame) {
+        uint64_t now = monotonic_ns();
+        if (frame_by_frame || now - debug_views_drawn >= DEBUG_VIEW_INTERVAL_NS) { // refreshed no faster than it can be seen
+            debug_views_drawn = now;
+            glutSetWindow(WindowDebug);
+            refresh_debug_views();
 
+            glutMainLoopEvent();
+            glutPostRedisplay();
+            glutSetWindow(WindowMain);
+        }
+        debug_frames_done++;
+    }
+    if (frame_by_frame) {
+        if (debug_frames_done >= debug_frameskip && !hide_lag) { // lag frames are stepped over
+            getchar();
+        }
+    } else if (!headless) {
+        framerate();
+    }
+    if (skip_frame) {
+        frames_skipped++;
+    } else {
+        frames_skipped = 0;
+        last_drawn_frame = monotonic_ns();
+    }
+    skip_frame = choose_frame_skip();
+}
+
+
+static void debug_hblank(void) {
+    /* show the frame so far and wait for input between scanlines */
+    getchar();
+    convert_framebuffer();
+    glutMainLoopEvent();
+    glutPostRedisplay();
+    glutSetWindow(WindowDebug);
+    refresh_debug_views();
+
+    glutMainLoopEvent();
+    glutPostRedisplay();
+    glutSetWindow(WindowMain);
+}
+
+
+static inline __attribute__((always_inline)) bool tick_ppu(const bool accurate) {
+    /* Shared body of the PPU engines. accurate is a constant in each instantiation, so the other
+    engine's timing is compiled out. The fast engine keeps the original fixed mode lengths and does
+    nothing between scheduled events. The accurate engine evaluates STAT on every dot, stretches
+    mode 3 by its penalties and enters VBlank at the start of line 144 */
+    if (!accurate && dot != next_event_dot) {
+        if (!lcd_enable) return 0;
+        dot++;
+        if (dot == DOTS_PER_FRAME) dot = 0;
+        return !dot;
+    }
+
+    bool mode_changed = 0;
     if (lcd_enable ^ (*(ram+REG_LCDC)>>7)) { //lcd state change
         if (*(ram+REG_LCDC)>>7) { // LCD was just turned on
             lcd_enable = 1;
@@ -933,7 +1817,7 @@ bool tick_graphics(void) {
             blank_screen();
         }
     }
-    *(ram+REG_LY) = (dot/456); // LY (scanline)
+    *(ram+REG_LY) = (dot/DOTS_PER_LINE); // LY (scanline)
     *(ram+REG_STAT) &= 0xFB;
     *(ram+REG_STAT) |= (*(ram+REG_LY) == *(ram+REG_LYC))<<2; // set LY=LYC flag
 
@@ -947,75 +1831,111 @@ bool tick_graphics(void) {
     old_stat_state = current_stat_state;
 
     if (lcd_enable) {
-        if (dot == 65564) { // enter VBLANK
+        uint16_t position = dot % DOTS_PER_LINE;
+        if (dot == (accurate ? ACCURATE_VBLANK_DOT : VBLANK_DOT)) { // enter VBLANK
             *(ram+REG_STAT) &= 0xFC;
             *(ram+REG_STAT) += 1; // set ppu mode to 1
             *(ram+REG_IF) |= 1; // Request a VBlank interrupt
-            xoffset++;
-            if (xoffset == SCREEN_HEIGHT) xoffset = 0;
-            window_internal_counter = 0;
-            glutMainLoopEvent();
-            glutPostRedisplay();
-            if (debug_tilemap) {
-                glutSetWindow(WindowDebug);
-                debug_tilemaps();
-                debug_sprites();
-                debug_vram(vram_block_1, 0x8000);
-                debug_vram(vram_block_2, 0x8800);
-                debug_vram(vram_block_3, 0x9000);
-
-                glutMainLoopEvent();
-                glutPostRedisplay();
-                glutSetWindow(WindowMain);
-                debug_frames_done++;
-            }
-            if (frame_by_frame) {
-                if (debug_frames_done >= debug_frameskip) {
-                    getchar();
-                }
-            } else {
-                framerate();
-            }
-        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && (dot % 456) == 0) { // New scanline
+            mode_changed = 1;
+            enter_vblank();
+        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && position == 0) { // New scanline
             *(ram+REG_STAT) &= 0xFC;
             *(ram+REG_STAT) += 2; // set ppu mode to 2
-            read_objects();
-            qsort(objects, objects_found, sizeof(ObjectAttribute), compare_obj_xvalue);
-        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && (dot % 456) == 80) { // Enter drawing mode
+            mode_changed = 1;
+            if (accurate || !skip_frame) read_objects(*(ram+REG_LY)); // the accurate engine needs objects to time mode 3
+        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && position == 80) { // Enter drawing mode
             *(ram+REG_STAT) &= 0xFC;
             *(ram+REG_STAT) += 3; // set ppu mode to 3
-            draw_background();
-            draw_window();
-            draw_objects();
+            mode_changed = 1;
+            if (accurate) hblank_position = 80 + mode3_length(*(ram+REG_LY));
+            if (!skip_frame) record_line(*(ram+REG_LY));
+            if (debug_scanlines) render_pending_lines(); // draw live so each line can be inspected
             if (debug_scanlines && debug_frames_done >= debug_frameskip) {
                 debug_tile_boundaries();
             }
 
-        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && (dot % 456) == 232) { // Enter Hblank
+        } else if ((*(ram+REG_LY) < SCREEN_HEIGHT) && position == (accurate ? hblank_position : 232)) { // Enter Hblank
             *(ram+REG_STAT) &= 0xFC; // set ppu mode to 0
+            mode_changed = 1;
             if (debug_scanlines && debug_frames_done >= debug_frameskip) {
-                getchar();
-                glutMainLoopEvent();
-                glutPostRedisplay();
-                glutSetWindow(WindowDebug);
-                debug_tilemaps();
-                debug_sprites();
-                debug_vram(vram_block_1, 0x8000);
-                debug_vram(vram_block_2, 0x8800);
-                debug_vram(vram_block_3, 0x9000);
-
-                glutMainLoopEvent();
-                glutPostRedisplay();
-                glutSetWindow(WindowMain);
+                debug_hblank();
             }
         }
 
         dot++;
-        if (dot == 70224) {
+        if (dot == DOTS_PER_FRAME) {
             dot = 0;
         }
+        // a mode change moves the STAT interrupt line on the following dot
+        if (!accurate) next_event_dot = mode_changed ? dot : find_next_event(dot);
         return !dot;
     } else {
+        if (!accurate) next_event_dot = NO_PPU_EVENT;
         return 0;
     }
-}
\ No newline at end of file
+}
+
+
+#define DEFINE_PPU_ENGINE(name, accurate) static bool name(void) { return tick_ppu(accurate); }
+DEFINE_PPU_ENGINE(tick_graphics_fast, 0)
+DEFINE_PPU_ENGINE(tick_graphics_accurate, 1)
+
+#ifdef ACCURATE_PPU
+bool (*tick_graphics)(void) = tick_graphics_accurate; //extern
+#else
+bool (*tick_graphics)(void) = tick_graphics_fast; //extern
+#endif
+
+
+void print_lag_frames(void) {
+    /* print how many frames the game spent without reading the joypad, a measure of how hard it is working */
+    if (!vblanks) return;
+    printf("Lag frames: %u of %u (%.1f%%)\n", lag_frames, vblanks, 100.0 * lag_frames / vblanks);
+}
+
+
+void hide_frame(bool hidden) {
+    /* set whether the next frame is hidden. Hidden frames generate no pixels and skip everything
+    done at VBlank except emulation, and the frame skip decision waits for the next shown frame */
+    if (hidden && !frame_hidden) skip_after_hidden = skip_frame;
+    if (!hidden && frame_hidden) skip_frame = skip_after_hidden;
+    frame_hidden = hidden;
+    if (hidden) skip_frame = 1;
+}
+
+
+void save_ppu_state(PpuState *state) {
+    /* copy the PPU's timing state into state. Called between frames, when no lines are waiting to be drawn */
+    state->dot = dot;
+    state->next_event_dot = next_event_dot;
+    state->hblank_position = hblank_position;
+    state->window_internal_counter = window_internal_counter;
+    state->old_stat_state = old_stat_state;
+    state->lcd_enable = lcd_enable;
+    state->lag_frame = lag_frame;
+    state->lag_frames = lag_frames;
+    state->vblanks = vblanks;
+}
+
+
+void load_ppu_state(const PpuState *state) {
+    /* restore the PPU state saved by save_ppu_state. VRAM and OAM were replaced without
+    being written to, so the tile cache and object index are rebuilt */
+    dot = state->dot;
+    next_event_dot = state->next_event_dot;
+    hblank_position = state->hblank_position;
+    window_internal_counter = state->window_internal_counter;
+    old_stat_state = state->old_stat_state;
+    lcd_enable = state->lcd_enable;
+    lag_frame = state->lag_frame;
+    lag_frames = state->lag_frames;
+    vblanks = state->vblanks;
+    memset(tile_cache_valid, 0, sizeof(tile_cache_valid));
+    oam_index_valid = 0;
+}
+
+
+void select_ppu_engine(bool accurate) {
+    /* choose the PPU engine that tick_graphics runs. The default is set by building with -DACCURATE_PPU */
+    tick_graphics = accurate ? tick_graphics_accurate : tick_graphics_fast;
+}
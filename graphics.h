@@ -17,6 +17,53 @@ typedef struct {
     bool palette;
 } ObjectAttribute;
 
+typedef struct {
+    uint8_t lcdc;
+    uint8_t scx;
+    uint8_t scy;
+    uint8_t wx;
+    uint8_t wy;
+    uint8_t bgp;
+    uint8_t obp0;
+    uint8_t obp1;
+    uint8_t window_line; // line of the window drawn on this scanline
+} LineState;
+
+typedef struct {
+    const uint8_t *vram; // contents of 0x8000-0x9FFF to draw from
+    bool use_tile_cache; // decoded tiles may be taken from the tile cache, which only matches live VRAM
+} TileSource;
+
+typedef struct {
+    GLuint texture; // created on first upload, in the context of the window showing it
+    GLuint pixel_buffer; // 0 if pixel buffer objects are not supported
+    int width;
+    int height;
+    GLubyte *uploaded; // pixels last uploaded to the texture, compared to find changed rows
+} TextureSurface;
+
+typedef struct {
+    uint32_t dot;
+    uint32_t next_event_dot;
+    uint16_t hblank_position;
+    uint8_t window_internal_counter;
+    bool old_stat_state;
+    bool lcd_enable;
+    bool lag_frame;
+    uint32_t lag_frames;
+    uint32_t vblanks;
+} PpuState;
+
+#define KEY_EVENT_PRESS 0
+#define KEY_EVENT_RELEASE 1
+#define KEY_EVENT_CLOSE 2
+
+typedef struct {
+    unsigned char key;
+    uint16_t modifiers; // glut modifiers held when the key was pressed
+    uint8_t type;
+} KeyEvent;
+
 void gl_tick(void);
 void gl_tick_debug_window(void);
 void reshape_window_ratio(int w, int h);
@@ -24,8 +71,20 @@ void reshape_window_free(int w, int h);
 void init_graphics(int *argc, char *argv[], char rom_title[16]);
 void window_closed(void);
 void take_screenshot(char *filename);
+uint64_t framebuffer_hash(void);
+void print_frame_jitter(void);
+void print_lag_frames(void);
 void key_pressed (unsigned char key, int x, int y);
 void key_released (unsigned char key, int x, int y);
-bool tick_graphics(void);
+extern bool (*tick_graphics)(void);
+void select_ppu_engine(bool accurate);
+void invalidate_tile(uint16_t addr);
+void invalidate_oam(void);
+void ppu_register_written(void);
+void render_pending_lines(void);
+void prepare_vram_write(void);
+void hide_frame(bool hidden);
+void save_ppu_state(PpuState *state);
+void load_ppu_state(const PpuState *state);
 
 #endif // GRAPHICS_H
\ No newline at end of file
@@ -21,6 +21,7 @@ Notes:
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <GL/freeglut.h>
 #include "miniaudio.h"
 #include "cpu.h"
@@ -29,9 +30,12 @@ Notes:
 #include "graphics.h"
 #include "mnemonics.h"
 #include "audio.h"
+#include "debug_export.h"
+#include "upscale.h"
 
 #include <unistd.h>
 
+#define CYCLES_PER_FRAME 70224
 
 uint8_t* ram; //extern
 FILE *logfile;
@@ -45,11 +49,34 @@ bool dmg_colours = 0; //extern
 bool debug_tilemap = 0; //extern
 bool debug_scanlines = 0; //extern
 bool frame_by_frame = 0; //extern
+bool render_thread = 0; //extern
+bool present_thread = 0; //extern
+int frameskip = 0; //extern, -1 for automatic
 char* save_filename; //extern
 bool do_save_game = 1; //extern
 bool hyperspeed = 0;
 bool no_audio = 0;
+bool audio_sync = 0; //extern
 bool no_display = 0;
+bool headless = 0; //extern
+bool accurate_ppu = 0; //extern
+long frame_limit = 0;
+bool print_frame_hash = 0;
+bool print_frame_stats = 0;
+bool export_debug = 0; //extern
+int upscale_filter = UPSCALE_NONE; //extern
+bool skip_lag_frames = 0; //extern
+int run_ahead = 0; // frames emulated past the one shown, 0 to disable
+static struct { // state run-ahead rewinds to after showing a frame
+    CpuState cpu;
+    InstructionState instructions;
+    CartridgeState cartridge;
+    PpuState ppu;
+    ApuState apu;
+    int8_t do_ei;
+    bool halt_state;
+    bool stop_mode;
+} snapshot;
 bool verbose_logging = 0;
 bool do_custom_save_name = 0;
 bool screenshot_on_halt = 0;
@@ -69,6 +96,7 @@ extern void (*scheduled_instructions[10])(void);
 extern uint8_t num_scheduled_instructions;
 extern uint8_t current_instruction_count;
 extern bool do_export_wav;
+extern bool audio_muted;
 extern int debug_frameskip;
 
 
@@ -88,6 +116,15 @@ void decode_launch_args(int argc, char *argv[]) {
         }
         if (!strcmp(argv[i], "--max-speed")) hyperspeed = 1;
         if (!strcmp(argv[i], "--windowless")) no_display = 1;
+        if (!strcmp(argv[i], "--headless")) headless = 1;
+        if (!strcmp(argv[i], "--accurate-ppu")) accurate_ppu = 1;
+        if (!strcmp(argv[i], "--frames")) {
+            if (i<argc-1) {
+                frame_limit = atol(argv[i+1]);
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "--print-hash")) print_frame_hash = 1;
         if (!strcmp(argv[i], "--debug")) verbose_logging = 1;
         if (!strcmp(argv[i], "--tilemap")) debug_tilemap = 1;
         if (!strcmp(argv[i], "--scanline")) {debug_tilemap = 1; debug_scanlines = 1;}
@@ -100,8 +137,41 @@ void decode_launch_args(int argc, char *argv[]) {
         if (!strcmp(argv[i], "--green")) dmg_colours = 1;
         if (!strcmp(argv[i], "--frame-by-frame")) frame_by_frame = 1;
         if (!strcmp(argv[i], "--no-audio")) no_audio = 1;
+        if (!strcmp(argv[i], "--audio-sync")) audio_sync = 1;
+        if (!strcmp(argv[i], "--render-thread")) render_thread = 1;
+        if (!strcmp(argv[i], "--present-thread")) present_thread = 1;
+        if (!strcmp(argv[i], "--frame-stats")) print_frame_stats = 1;
+        if (!strcmp(argv[i], "--skip-lag-frames")) skip_lag_frames = 1;
+        if (!strcmp(argv[i], "--export-debug")) export_debug = 1;
+        if (!strcmp(argv[i], "--upscale")) {
+            if (i<argc-1) {
+                upscale_filter = parse_upscale_filter(argv[i+1]);
+                if (!upscale_filter) fprintf(stderr, "Unknown upscale filter '%s', showing frames unfiltered\n", argv[i+1]);
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "--run-ahead")) {
+            if (i<argc-1) {
+                run_ahead = atol(argv[i+1]);
+                i++;
+            }
+        }
+        if (!strcmp(argv[i], "--frameskip")) {
+            if (i<argc-1) {
+                frameskip = strcmp(argv[i+1], "auto") ? atol(argv[i+1]) : -1;
+                i++;
+            }
+        }
         if (!strcmp(argv[i], "--export-wav")) do_export_wav = 1;
     }
+    if (headless) { // the debugger needs a window
+        debug_tilemap = 0;
+        debug_scanlines = 0;
+    }
+    if (no_audio) audio_sync = 0; // there is no device to follow
+    if (headless || debug_tilemap) present_thread = 0; // the debugger draws its window from the emulation thread
+    if (no_display || debug_tilemap || run_ahead < 0) run_ahead = 0; // frames are counted by the PPU, and the debugger shows every frame
+    if (headless) upscale_filter = UPSCALE_NONE; // nothing is shown to be upscaled
 }
 
 
@@ -122,6 +192,166 @@ bool service_interrupts(void) {
 }
 
 
+static inline bool run_cycle(void) {
+    /* run the gameboy for one t-cycle. Returns whether the PPU finished a frame */
+    bool frame_done = 0;
+    //fprintf(stderr, "%d | (%d, %d) | %d | %d\n", system_counter, current_instruction_count, num_scheduled_instructions, halt_state, stop_mode);
+    increment_timers();
+    if (stop_mode) {
+        if ((*(ram+REG_JOYP)&0xF) != 0xF) {
+            if (!no_audio) catch_up_audio(); // skips the cycles spent stopped
+            stop_mode = 0;
+        }
+    } else {
+
+        if (!(system_counter&3)) {
+            if (OAM_DMA_starter) {
+                OAM_DMA_starter--;
+                if (!OAM_DMA_starter) {
+                    // fprintf(stderr, "DMA: starting at sysclk=0x%.4x\n", system_counter);
+                    // printf("DMA: starting at sysclk=0x%.4x\n", system_counter);
+                    OAM_DMA = 1;
+                    OAM_DMA_timeout = 0;
+                }
+            }
+            if (OAM_DMA) read_dma();
+
+            if (TIMA_overflow_delay) { // do TIMA overflow late
+                TIMA_overflow_delay--;
+                if ((!*(ram+REG_TIMA)) && (!TIMA_overflow_delay)) {
+                    *(ram+REG_TIMA) = *(ram+REG_TMA); // reset to TMA
+                    *(ram+REG_IF) |= 1<<2; // request a timer interrupt
+                    TIMA_overflow_flag = 1;
+                }
+            }
+
+
+            if (current_instruction_count == num_scheduled_instructions) {
+                if (do_ei > 0) {
+                    do_ei--;
+                    if (!do_ei)set_ime(1); // set EI late
+                }
+
+
+                if (verbose_logging) fprintf(logfile, "A:%.2x F:%.2x B:%.2x C:%.2x D:%.2x E:%.2x H:%.2x L:%.2x SP:%.4x PC:%.4x PCMEM:%.2x,%.2x,%.2x,%.2x IME:%d HALTMODE:%d STOP:%d IE:%.2x IF:%.2x OPCODES: %s\n",
+                    get_r8(R8A),get_r8(R8F),get_r8(R8B),get_r8(R8C),
+                    get_r8(R8D),get_r8(R8E),get_r8(R8H),get_r8(R8L),
+                    get_r16(R16SP),get_r16(R16PC),
+                    *(ram+get_r16(R16PC)),*(ram+get_r16(R16PC)+1),*(ram+get_r16(R16PC)+2),*(ram+get_r16(R16PC)+3),
+                    reg.IME, halt_state, stop_mode, *(ram+REG_IE), *(ram+REG_IF),
+                    ((*(ram+get_r16(R16PC))==0xCB) ? mn_cb_opcodes[*(ram+get_r16(R16PC)+1)] : mn_opcodes[*(ram+get_r16(R16PC))])
+                );
+
+                if (halt_state && (*(ram+REG_IF)&*(ram+REG_IE)&0x1F)) { //An interrupt is now pending to quit HALT
+                    halt_state = 0;
+                }
+                if (!halt_state) service_interrupts();
+
+                if ((!halt_state) && (current_instruction_count == num_scheduled_instructions)) {
+                    queue_instruction();
+                }
+            }
+
+
+            // printf("\ncount %d/%d | sysclk=0x%.4x", current_instruction_count, num_scheduled_instructions, system_counter);
+            // if (current_instruction_count == 0) {
+            //     printf(" | OPCODE=0x%.2x PC=0x%.4x INSTR=%s\n", *(ram+get_r16(R16PC)), get_r16(R16PC), ((*(ram+get_r16(R16PC))==0xCB) ? mn_cb_opcodes[*(ram+get_r16(R16PC)+1)] : mn_opcodes[*(ram+get_r16(R16PC))]));
+            // } else {
+            //     printf("\n");
+            // }
+
+            if (!halt_state) {
+                scheduled_instructions[current_instruction_count]();
+                current_instruction_count++;
+
+                if (do_haltmode) { // HALT was called:
+                    if (do_haltmode == 2) {
+                        if (!no_audio) catch_up_audio(); // the APU stops after this cycle
+                        stop_mode = 1;
+                    } else {
+                        halt_state = 1;
+                    }
+                    do_haltmode = 0;
+                }
+                if ((do_ei_set==1) && (do_ei == 0)) {
+                    do_ei = 2;
+                    do_ei_set = 0;
+                } else if (do_ei_set == -1) {
+                    do_ei_set = 0;
+                    do_ei = 0;
+                }
+            }
+            TIMA_overflow_flag = 0;
+        }
+        if (!no_display) frame_done = tick_graphics();
+        //usleep(10);
+    }
+    return frame_done;
+}
+
+
+static bool run_frame(void) {
+    /* run until the PPU finishes a frame, or for a frame's worth of cycles while the LCD is off,
+    then make the frame's audio. Returns whether the PPU finished a frame */
+    bool frame_done = 0;
+    for (uint32_t cycle=0; cycle<CYCLES_PER_FRAME; cycle++) {
+        if (run_cycle()) {
+            frame_done = 1;
+            break;
+        }
+        if (!LOOP) break;
+    }
+    if (!no_audio) catch_up_audio();
+    return frame_done;
+}
+
+
+static void save_snapshot(void) {
+    /* copy the state of every part of the gameboy into the run-ahead snapshot */
+    save_cpu_state(&snapshot.cpu);
+    save_instruction_state(&snapshot.instructions);
+    save_cartridge_state(&snapshot.cartridge);
+    save_ppu_state(&snapshot.ppu);
+    save_apu_state(&snapshot.apu);
+    snapshot.do_ei = do_ei;
+    snapshot.halt_state = halt_state;
+    snapshot.stop_mode = stop_mode;
+}
+
+
+static void load_snapshot(void) {
+    /* return every part of the gameboy to the run-ahead snapshot */
+    load_cpu_state(&snapshot.cpu);
+    load_instruction_state(&snapshot.instructions);
+    load_cartridge_state(&snapshot.cartridge);
+    load_ppu_state(&snapshot.ppu);
+    load_apu_state(&snapshot.apu);
+    do_ei = snapshot.do_ei;
+    halt_state = snapshot.halt_state;
+    stop_mode = snapshot.stop_mode;
+}
+
+
+static bool run_ahead_frame(void) {
+    /* run one frame unseen, then run_ahead frames past it with the current input, showing the last
+    of them silently, and rewind to the end of the first. The game's response to input is shown
+    run_ahead frames sooner. Returns whether the PPU finished the first frame */
+    hide_frame(1);
+    bool frame_done = run_frame();
+    if (!LOOP) return frame_done;
+    save_snapshot();
+    audio_muted = 1;
+    for (int i=0; i<run_ahead && LOOP; i++) {
+        hide_frame(i < run_ahead-1);
+        run_frame();
+    }
+    audio_muted = 0;
+    load_snapshot();
+    joypad_io(); // input read while running ahead was applied to the discarded frames
+    return frame_done;
+}
+
+
 int main(int argc, char *argv[]) {
     load_rom(argv[1]);
     decode_launch_args(argc, argv);
@@ -134,99 +364,17 @@ int main(int argc, char *argv[]) {
     }
 
     if (!no_audio) init_audio();
+    if (export_debug && !no_display) export_debug = init_debug_export(); // exported at VBlank, so the PPU must run
     if (!no_display) init_graphics(&argc, argv, rom.title);
     if (verbose_logging) {
         logfile = fopen("cpu_states.log", "w");
     }
 
+    long frames_run = 0;
     while (LOOP) {
-        //fprintf(stderr, "%d | (%d, %d) | %d | %d\n", system_counter, current_instruction_count, num_scheduled_instructions, halt_state, stop_mode);
-        increment_timers();
-        if (stop_mode) {
-            if ((*(ram+REG_JOYP)&0xF) != 0xF) stop_mode = 0; 
-        } else {
-
-            if (!(system_counter&3)) {
-                if (OAM_DMA_starter) {
-                    OAM_DMA_starter--;
-                    if (!OAM_DMA_starter) {
-                        // fprintf(stderr, "DMA: starting at sysclk=0x%.4x\n", system_counter);
-                        // printf("DMA: starting at sysclk=0x%.4x\n", system_counter);
-                        OAM_DMA = 1;
-                        OAM_DMA_timeout = 0;
-                    }
-                }
-                if (OAM_DMA) read_dma();
-
-                if (TIMA_overflow_delay) { // do TIMA overflow late
-                    TIMA_overflow_delay--;
-                    if ((!*(ram+REG_TIMA)) && (!TIMA_overflow_delay)) {
-                        *(ram+REG_TIMA) = *(ram+REG_TMA); // reset to TMA
-                        *(ram+REG_IF) |= 1<<2; // request a timer interrupt
-                        TIMA_overflow_flag = 1;
-                    }
-                }
-
-
-                if (current_instruction_count == num_scheduled_instructions) {
-                    if (do_ei > 0) {
-                        do_ei--;
-                        if (!do_ei)set_ime(1); // set EI late
-                    }
-
-
-                    if (verbose_logging) fprintf(logfile, "A:%.2x F:%.2x B:%.2x C:%.2x D:%.2x E:%.2x H:%.2x L:%.2x SP:%.4x PC:%.4x PCMEM:%.2x,%.2x,%.2x,%.2x IME:%d HALTMODE:%d STOP:%d IE:%.2x IF:%.2x OPCODES: %s\n",
-                        get_r8(R8A),get_r8(R8F),get_r8(R8B),get_r8(R8C),
-                        get_r8(R8D),get_r8(R8E),get_r8(R8H),get_r8(R8L),
-                        get_r16(R16SP),get_r16(R16PC),
-                        *(ram+get_r16(R16PC)),*(ram+get_r16(R16PC)+1),*(ram+get_r16(R16PC)+2),*(ram+get_r16(R16PC)+3),
-                        reg.IME, halt_state, stop_mode, *(ram+REG_IE), *(ram+REG_IF),
-                        ((*(ram+get_r16(R16PC))==0xCB) ? mn_cb_opcodes[*(ram+get_r16(R16PC)+1)] : mn_opcodes[*(ram+get_r16(R16PC))])
-                    );
-
-                    if (halt_state && (*(ram+REG_IF)&*(ram+REG_IE)&0x1F)) { //An interrupt is now pending to quit HALT
-                        halt_state = 0;
-                    }
-                    if (!halt_state) service_interrupts();
-
-                    if ((!halt_state) && (current_instruction_count == num_scheduled_instructions)) {
-                        queue_instruction();
-                    }
-                }
-
-
-                // printf("\ncount %d/%d | sysclk=0x%.4x", current_instruction_count, num_scheduled_instructions, system_counter);
-                // if (current_instruction_count == 0) {
-                //     printf(" | OPCODE=0x%.2x PC=0x%.4x INSTR=%s\n", *(ram+get_r16(R16PC)), get_r16(R16PC), ((*(ram+get_r16(R16PC))==0xCB) ? mn_cb_opcodes[*(ram+get_r16(R16PC)+1)] : mn_opcodes[*(ram+get_r16(R16PC))]));
-                // } else {
-                //     printf("\n");
-                // }
-
-                if (!halt_state) {
-                    scheduled_instructions[current_instruction_count]();
-                    current_instruction_count++;
-
-                    if (do_haltmode) { // HALT was called:
-                        if (do_haltmode == 2) {
-                            stop_mode = 1;
-                        } else {
-                            halt_state = 1;
-                        }
-                        do_haltmode = 0;
-                    }
-                    if ((do_ei_set==1) && (do_ei == 0)) {
-                        do_ei = 2;
-                        do_ei_set = 0;
-                    } else if (do_ei_set == -1) {
-                        do_ei_set = 0;
-                        do_ei = 0;
-                    }
-                }
-                TIMA_overflow_flag = 0;
-            }
-            if (!no_display) tick_graphics();
-            if (!no_audio) tick_audio();
-            //usleep(10);
+        if (run_ahead ? run_ahead_frame() : run_frame()) {
+            frames_run++;
+            if (frames_run == frame_limit) LOOP = 0;
         }
     }
     
@@ -235,8 +383,16 @@ int main(int argc, char *argv[]) {
         take_screenshot(screenshot_filename);
         free(screenshot_filename);
     }
+    if (!no_display && print_frame_hash) {
+        printf("framebuffer hash: %.16lx\n", framebuffer_hash());
+    }
+    if (!no_display && print_frame_stats) {
+        print_frame_jitter();
+        print_lag_frames();
+    }
 
     if (!no_audio) close_audio();
+    if (export_debug) close_debug_export();
 
     // write save ram to a file
     if (do_save_game) {
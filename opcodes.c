@@ -1833,4 +1833,39 @@ void load_interrupt_instructions(uint8_t isr) {
     // reg.SP-=2; //execute a CALL (push PC to stack)
     // write_word(reg.SP, reg.PC);
     // set_r16(R16PC, 0x40+(isr<<3)); // go to corresponding isr add
-}
\ No newline at end of file
+}
+
+
+void save_instruction_state(InstructionState *state) {
+    /* copy the queued atomic instructions and their working values into state, so an instruction
+    interrupted part way through can be resumed */
+    memcpy(state->scheduled_instructions, scheduled_instructions, sizeof(scheduled_instructions));
+    state->num_scheduled_instructions = num_scheduled_instructions;
+    state->current_instruction_count = current_instruction_count;
+    state->do_ei_set = do_ei_set;
+    state->do_haltmode = do_haltmode;
+    state->r8 = r8;
+    state->r16 = r16;
+    state->Z = Z;
+    state->W = W;
+    state->addr = addr;
+    state->working_bit = working_bit;
+    state->do_zflag = do_zflag;
+}
+
+
+void load_instruction_state(const InstructionState *state) {
+    /* restore the instruction state saved by save_instruction_state */
+    memcpy(scheduled_instructions, state->scheduled_instructions, sizeof(scheduled_instructions));
+    num_scheduled_instructions = state->num_scheduled_instructions;
+    current_instruction_count = state->current_instruction_count;
+    do_ei_set = state->do_ei_set;
+    do_haltmode = state->do_haltmode;
+    r8 = state->r8;
+    r16 = state->r16;
+    Z = state->Z;
+    W = state->W;
+    addr = state->addr;
+    working_bit = state->working_bit;
+    do_zflag = state->do_zflag;
+}
@@ -7,7 +7,24 @@
 #ifndef OPCODES_H
 #define OPCODES_H
 
+typedef struct {
+    void (*scheduled_instructions[10])(void);
+    uint8_t num_scheduled_instructions;
+    uint8_t current_instruction_count;
+    int8_t do_ei_set;
+    uint8_t do_haltmode;
+    uint8_t r8;
+    uint8_t r16;
+    uint8_t Z;
+    uint8_t W;
+    uint16_t addr;
+    bool working_bit;
+    bool do_zflag;
+} InstructionState;
+
 void queue_instruction(void);
 void load_interrupt_instructions(uint8_t isr);
+void save_instruction_state(InstructionState *state);
+void load_instruction_state(const InstructionState *state);
 
 #endif // OPCODES_H
\ No newline at end of file
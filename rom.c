@@ -688,4 +688,30 @@ void free_rom_data(void) {
     free(rom.rom_data);
     free(rom.external_ram);
     free(ram);
-}
\ No newline at end of file
+}
+
+
+static inline int external_ram_length(void) {
+    /* number of bytes allocated for external RAM. MBC2 has its own RAM, which the header does not describe */
+    return rom.mbc_type == MBANK_2 ? 0x0200 : rom.external_ram_size;
+}
+
+
+void save_cartridge_state(CartridgeState *state) {
+    /* copy the MBC registers and external RAM into state */
+    state->MBANK_mode = MBANK_mode;
+    state->MBANK_reg_BANK1 = MBANK_reg_BANK1;
+    state->MBANK_reg_BANK2 = MBANK_reg_BANK2;
+    state->MBANK_RAMG = MBANK_RAMG;
+    if (rom.external_ram) memcpy(state->external_ram, rom.external_ram, external_ram_length());
+}
+
+
+void load_cartridge_state(const CartridgeState *state) {
+    /* restore the MBC registers and external RAM saved by save_cartridge_state */
+    MBANK_mode = state->MBANK_mode;
+    MBANK_reg_BANK1 = state->MBANK_reg_BANK1;
+    MBANK_reg_BANK2 = state->MBANK_reg_BANK2;
+    MBANK_RAMG = state->MBANK_RAMG;
+    if (rom.external_ram) memcpy(rom.external_ram, state->external_ram, external_ram_length());
+}
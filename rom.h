@@ -9,6 +9,7 @@
 
 #define HEADER_START 0x0134
 #define HEADER_SIZE 25
+#define MAX_EXTERNAL_RAM_SIZE (1<<15)
 
 enum MBCType {
   MBANK_NONE=0,
@@ -44,6 +45,14 @@ typedef struct {
     char title[16];
 } gbRom;
 
+typedef struct {
+    bool MBANK_mode;
+    uint16_t MBANK_reg_BANK1;
+    uint8_t MBANK_reg_BANK2;
+    bool MBANK_RAMG;
+    uint8_t external_ram[MAX_EXTERNAL_RAM_SIZE];
+} CartridgeState;
+
 void init_rom(FILE* romfile);
 void print_error(char errormsg[]);
 void load_rom(char filename[]);
@@ -52,5 +61,7 @@ char* replace_file_extension(char* filename, char* extension);
 void load_external_ram(char* filename);
 void save_external_ram(char* filename);
 void free_rom_data(void);
+void save_cartridge_state(CartridgeState *state);
+void load_cartridge_state(const CartridgeState *state);
 
 #endif // ROM_H
\ No newline at end of file
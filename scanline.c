@@ -0,0 +1,139 @@
+/* Source file for scanline.c, turning a composited line of colour ids into shades.
+    The background and window are first assembled into one line of colour ids by
+    copying whole pre-decoded tile rows. Each kernel here then applies BGP to the
+    line and builds the row of bgw_priority_map, which is set wherever the line or
+    the background under the window has a non-zero colour id. Once the objects on the
+    line have been resolved into a sprite line buffer, a second set of kernels blends
+    that buffer over the shades wherever its mask byte is 0xFF.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "scanline.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static const char* kernel_name = "portable";
+
+BgwRowMapper map_bgw_row = map_bgw_row_portable; //extern
+ObjectRowBlender blend_object_row = blend_object_row_portable; //extern
+
+
+void map_bgw_row_portable(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count) {
+    /* map a line one pixel at a time */
+    for (int i=0; i<count; i++) {
+        shades[i] = palette[ids[i]&3];
+        opaque[i] = (ids[i] | under[i]) != 0;
+    }
+}
+
+
+void blend_object_row_portable(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count) {
+    /* blend a sprite line buffer over a line one pixel at a time */
+    for (int i=0; i<count; i++) {
+        shades[i] = (objects[i] & mask[i]) | (shades[i] & ~mask[i]);
+    }
+}
+
+
+#ifdef __x86_64__
+void map_bgw_row_sse2(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count) {
+    /* map a line 16 pixels at a time. SSE2 has no byte shuffle, so each of the four
+    colour ids is matched and its shade selected with a mask */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i colour[4], shade[4];
+    for (int k=0; k<4; k++) {
+        colour[k] = _mm_set1_epi8(k);
+        shade[k] = _mm_set1_epi8(palette[k]);
+    }
+    int i = 0;
+    for (; i+16<=count; i+=16) {
+        __m128i id = _mm_loadu_si128((const __m128i*)(ids+i));
+        __m128i below = _mm_loadu_si128((const __m128i*)(under+i));
+        __m128i result = _mm_and_si128(_mm_cmpeq_epi8(id, colour[0]), shade[0]);
+        for (int k=1; k<4; k++) {
+            result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(id, colour[k]), shade[k]));
+        }
+        _mm_storeu_si128((__m128i*)(shades+i), result);
+        __m128i transparent = _mm_cmpeq_epi8(_mm_or_si128(id, below), zero);
+        _mm_storeu_si128((__m128i*)(opaque+i), _mm_andnot_si128(transparent, one));
+    }
+    map_bgw_row_portable(ids+i, under+i, palette, shades+i, opaque+i, count-i);
+}
+
+
+__attribute__((target("avx2")))
+void map_bgw_row_avx2(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count) {
+    /* map a line 32 pixels at a time, looking up shades with a byte shuffle */
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i lut = _mm256_setr_epi8(
+        palette[0], palette[1], palette[2], palette[3], 0,0,0,0, 0,0,0,0, 0,0,0,0,
+        palette[0], palette[1], palette[2], palette[3], 0,0,0,0, 0,0,0,0, 0,0,0,0
+    );
+    int i = 0;
+    for (; i+32<=count; i+=32) {
+        __m256i id = _mm256_loadu_si256((const __m256i*)(ids+i));
+        __m256i below = _mm256_loadu_si256((const __m256i*)(under+i));
+        _mm256_storeu_si256((__m256i*)(shades+i), _mm256_shuffle_epi8(lut, id));
+        __m256i transparent = _mm256_cmpeq_epi8(_mm256_or_si256(id, below), zero);
+        _mm256_storeu_si256((__m256i*)(opaque+i), _mm256_andnot_si256(transparent, one));
+    }
+    map_bgw_row_portable(ids+i, under+i, palette, shades+i, opaque+i, count-i);
+}
+
+
+void blend_object_row_sse2(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count) {
+    /* blend 16 pixels at a time. SSE2 has no byte blend, so the mask selects with and/andnot */
+    int i = 0;
+    for (; i+16<=count; i+=16) {
+        __m128i select = _mm_loadu_si128((const __m128i*)(mask+i));
+        __m128i object = _mm_and_si128(select, _mm_loadu_si128((const __m128i*)(objects+i)));
+        __m128i below = _mm_andnot_si128(select, _mm_loadu_si128((const __m128i*)(shades+i)));
+        _mm_storeu_si128((__m128i*)(shades+i), _mm_or_si128(object, below));
+    }
+    blend_object_row_portable(objects+i, mask+i, shades+i, count-i);
+}
+
+
+__attribute__((target("avx2")))
+void blend_object_row_avx2(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count) {
+    /* blend 32 pixels at a time with a byte blend */
+    int i = 0;
+    for (; i+32<=count; i+=32) {
+        __m256i select = _mm256_loadu_si256((const __m256i*)(mask+i));
+        __m256i object = _mm256_loadu_si256((const __m256i*)(objects+i));
+        __m256i below = _mm256_loadu_si256((const __m256i*)(shades+i));
+        _mm256_storeu_si256((__m256i*)(shades+i), _mm256_blendv_epi8(below, object, select));
+    }
+    blend_object_row_portable(objects+i, mask+i, shades+i, count-i);
+}
+#endif
+
+
+void init_scanline(void) {
+    /* select the widest line mapping and blending kernels supported by the host cpu. SSE2 is always present on x86-64 */
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    map_bgw_row = map_bgw_row_sse2;
+    blend_object_row = blend_object_row_sse2;
+    kernel_name = "sse2";
+    if (__builtin_cpu_supports("avx2")) {
+        map_bgw_row = map_bgw_row_avx2;
+        blend_object_row = blend_object_row_avx2;
+        kernel_name = "avx2";
+    }
+#endif
+}
+
+
+const char* scanline_kernel_name(void) {
+    /* get the name of the currently selected line mapping kernel */
+    return kernel_name;
+}
@@ -0,0 +1,28 @@
+/* Header file for scanline.c, turning a composited line of colour ids into shades
+  Author: Max Croucher
+  Email: mpccroucher@gmail.com
+  October 2026
+*/
+
+#ifndef SCANLINE_H
+#define SCANLINE_H
+
+typedef void (*BgwRowMapper)(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count);
+
+typedef void (*ObjectRowBlender)(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count);
+
+extern BgwRowMapper map_bgw_row;
+extern ObjectRowBlender blend_object_row;
+
+void map_bgw_row_portable(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count);
+void blend_object_row_portable(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count);
+#ifdef __x86_64__
+void map_bgw_row_sse2(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count);
+void map_bgw_row_avx2(const uint8_t *ids, const uint8_t *under, const uint8_t palette[4], uint8_t *shades, uint8_t *opaque, int count);
+void blend_object_row_sse2(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count);
+void blend_object_row_avx2(const uint8_t *objects, const uint8_t *mask, uint8_t *shades, int count);
+#endif
+void init_scanline(void);
+const char* scanline_kernel_name(void);
+
+#endif // SCANLINE_H
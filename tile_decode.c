@@ -0,0 +1,80 @@
+/* Source file for tile_decode.c, converting gameboy 2bpp tile rows into colour ids.
+    A tile row is stored as two bitplanes: the low byte holds bit 0 of each pixel and
+    the high byte holds bit 1, with the leftmost pixel in bit 7. Each decoder returns
+    the eight 2-bit colour ids packed one per byte, leftmost pixel in the lowest byte,
+    so the result can be copied straight into a row of the tile cache.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "tile_decode.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static uint64_t row_expand[256]; // each bit of a bitplane byte spread into its own byte, leftmost pixel first
+static const char* kernel_name = "portable";
+
+TileRowDecoder decode_tile_row = decode_tile_row_portable; //extern
+
+
+uint64_t decode_tile_row_portable(uint8_t low, uint8_t high) {
+    /* decode a row one pixel at a time. Used when no faster kernel has been selected */
+    uint64_t row = 0;
+    for (int col=0; col<8; col++) {
+        uint64_t pix = ((low>>(7-col))&1) | (((high>>(7-col))&1)<<1);
+        row |= pix << (8*col);
+    }
+    return row;
+}
+
+
+uint64_t decode_tile_row_lut(uint8_t low, uint8_t high) {
+    /* decode a row with two lookups into the bitplane expansion table */
+    return row_expand[low] | (row_expand[high]<<1);
+}
+
+
+#ifdef __x86_64__
+__attribute__((target("bmi2")))
+uint64_t decode_tile_row_bmi2(uint8_t low, uint8_t high) {
+    /* deposit each bitplane into bit 0 or bit 1 of every byte, then swap so the leftmost pixel comes first */
+    uint64_t row = _pdep_u64(low, 0x0101010101010101ULL) | _pdep_u64(high, 0x0202020202020202ULL);
+    return __builtin_bswap64(row);
+}
+#endif
+
+
+static void build_row_expand(void) {
+    /* fill the expansion table used by the lookup kernel */
+    for (int i=0; i<256; i++) {
+        row_expand[i] = decode_tile_row_portable(i, 0);
+    }
+}
+
+
+void init_tile_decode(void) {
+    /* select the fastest tile row decoder supported by the host cpu */
+    build_row_expand();
+    decode_tile_row = decode_tile_row_lut;
+    kernel_name = "lut";
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    // pdep is microcoded and far slower than the table on AMD cores before Zen 3
+    bool slow_pdep = __builtin_cpu_is("amdfam15h") || __builtin_cpu_is("znver1") || __builtin_cpu_is("znver2");
+    if (__builtin_cpu_supports("bmi2") && !slow_pdep) {
+        decode_tile_row = decode_tile_row_bmi2;
+        kernel_name = "bmi2";
+    }
+#endif
+}
+
+
+const char* tile_decode_kernel_name(void) {
+    /* get the name of the currently selected tile row decoder */
+    return kernel_name;
+}
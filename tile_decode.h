@@ -0,0 +1,22 @@
+/* Header file for tile_decode.c, converting gameboy 2bpp tile rows into colour ids
+  Author: Max Croucher
+  Email: mpccroucher@gmail.com
+  October 2026
+*/
+
+#ifndef TILE_DECODE_H
+#define TILE_DECODE_H
+
+typedef uint64_t (*TileRowDecoder)(uint8_t low, uint8_t high);
+
+extern TileRowDecoder decode_tile_row;
+
+uint64_t decode_tile_row_portable(uint8_t low, uint8_t high);
+uint64_t decode_tile_row_lut(uint8_t low, uint8_t high);
+#ifdef __x86_64__
+uint64_t decode_tile_row_bmi2(uint8_t low, uint8_t high);
+#endif
+void init_tile_decode(void);
+const char* tile_decode_kernel_name(void);
+
+#endif // TILE_DECODE_H
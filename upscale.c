@@ -0,0 +1,307 @@
+/* Source file for upscale.c, enlarging finished frames with pixel art filters.
+    Scale2x and scale3x work on the framebuffer's shades rather than on RGB, so every
+    pixel is one byte and the neighbour comparisons vectorise across 16 or 32 pixels.
+    Their output is still made of shades and goes through the usual colour conversion.
+    Pixels past the edge of the frame repeat the edge pixel. xbr2x is a small xBR
+    style filter: it finds edges from the brightness of a 5x5 neighbourhood, and
+    blends each corner of the enlarged pixel with the colour across the edge, so it
+    writes RGB directly.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "upscale.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static const char* kernel_name = "portable";
+
+Scale2xRow scale2x_row = scale2x_row_portable; //extern
+Scale3xRow scale3x_row = scale3x_row_portable; //extern
+
+
+static inline void scale2x_pixel(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int x, int count) {
+    /* enlarge one pixel into a 2x2 block */
+    uint8_t b = above[x], e = row[x], h = below[x];
+    uint8_t d = row[x > 0 ? x-1 : x];
+    uint8_t f = row[x < count-1 ? x+1 : x];
+    if (b != h && d != f) {
+        out0[2*x] = d == b ? d : e;
+        out0[2*x+1] = b == f ? f : e;
+        out1[2*x] = d == h ? d : e;
+        out1[2*x+1] = h == f ? f : e;
+    } else {
+        out0[2*x] = out0[2*x+1] = out1[2*x] = out1[2*x+1] = e;
+    }
+}
+
+
+static inline void scale3x_pixel(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int x, int count) {
+    /* enlarge one pixel into a 3x3 block */
+    int left = x > 0 ? x-1 : x;
+    int right = x < count-1 ? x+1 : x;
+    uint8_t a = above[left], b = above[x], c = above[right];
+    uint8_t d = row[left], e = row[x], f = row[right];
+    uint8_t g = below[left], h = below[x], i = below[right];
+    if (b != h && d != f) {
+        out0[3*x] = d == b ? d : e;
+        out0[3*x+1] = ((d == b && e != c) || (b == f && e != a)) ? b : e;
+        out0[3*x+2] = b == f ? f : e;
+        out1[3*x] = ((d == b && e != g) || (d == h && e != a)) ? d : e;
+        out1[3*x+1] = e;
+        out1[3*x+2] = ((b == f && e != i) || (h == f && e != c)) ? f : e;
+        out2[3*x] = d == h ? d : e;
+        out2[3*x+1] = ((d == h && e != i) || (h == f && e != g)) ? h : e;
+        out2[3*x+2] = h == f ? f : e;
+    } else {
+        out0[3*x] = out0[3*x+1] = out0[3*x+2] = e;
+        out1[3*x] = out1[3*x+1] = out1[3*x+2] = e;
+        out2[3*x] = out2[3*x+1] = out2[3*x+2] = e;
+    }
+}
+
+
+void scale2x_row_portable(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count) {
+    /* enlarge a row one pixel at a time */
+    for (int x=0; x<count; x++) scale2x_pixel(above, row, below, out0, out1, x, count);
+}
+
+
+void scale3x_row_portable(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int count) {
+    /* enlarge a row one pixel at a time */
+    for (int x=0; x<count; x++) scale3x_pixel(above, row, below, out0, out1, out2, x, count);
+}
+
+
+#ifdef __x86_64__
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b) {
+    /* take bytes from a where mask is set and from b elsewhere */
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+
+void scale2x_row_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count) {
+    /* enlarge 16 pixels at a time, interleaving the left and right halves of each block with unpacks.
+    The first and last pixels have a missing neighbour and are done one at a time */
+    if (count < 1) return;
+    scale2x_pixel(above, row, below, out0, out1, 0, count);
+    int x = 1;
+    for (; x+16<=count-1; x+=16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(above+x));
+        __m128i h = _mm_loadu_si128((const __m128i*)(below+x));
+        __m128i e = _mm_loadu_si128((const __m128i*)(row+x));
+        __m128i d = _mm_loadu_si128((const __m128i*)(row+x-1));
+        __m128i f = _mm_loadu_si128((const __m128i*)(row+x+1));
+        __m128i any = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f)); // set where the block is all e
+        __m128i e0 = select_sse2(_mm_andnot_si128(any, _mm_cmpeq_epi8(d, b)), d, e);
+        __m128i e1 = select_sse2(_mm_andnot_si128(any, _mm_cmpeq_epi8(b, f)), f, e);
+        __m128i e2 = select_sse2(_mm_andnot_si128(any, _mm_cmpeq_epi8(d, h)), d, e);
+        __m128i e3 = select_sse2(_mm_andnot_si128(any, _mm_cmpeq_epi8(h, f)), f, e);
+        _mm_storeu_si128((__m128i*)(out0+2*x), _mm_unpacklo_epi8(e0, e1));
+        _mm_storeu_si128((__m128i*)(out0+2*x+16), _mm_unpackhi_epi8(e0, e1));
+        _mm_storeu_si128((__m128i*)(out1+2*x), _mm_unpacklo_epi8(e2, e3));
+        _mm_storeu_si128((__m128i*)(out1+2*x+16), _mm_unpackhi_epi8(e2, e3));
+    }
+    for (; x<count; x++) scale2x_pixel(above, row, below, out0, out1, x, count);
+}
+
+
+__attribute__((target("avx2")))
+void scale2x_row_avx2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count) {
+    /* enlarge 32 pixels at a time. The unpacks work within each 128-bit lane,
+    so the two halves are put back in order with a lane permute */
+    if (count < 1) return;
+    scale2x_pixel(above, row, below, out0, out1, 0, count);
+    int x = 1;
+    for (; x+32<=count-1; x+=32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(above+x));
+        __m256i h = _mm256_loadu_si256((const __m256i*)(below+x));
+        __m256i e = _mm256_loadu_si256((const __m256i*)(row+x));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(row+x-1));
+        __m256i f = _mm256_loadu_si256((const __m256i*)(row+x+1));
+        __m256i any = _mm256_or_si256(_mm256_cmpeq_epi8(b, h), _mm256_cmpeq_epi8(d, f));
+        __m256i e0 = _mm256_blendv_epi8(e, d, _mm256_andnot_si256(any, _mm256_cmpeq_epi8(d, b)));
+        __m256i e1 = _mm256_blendv_epi8(e, f, _mm256_andnot_si256(any, _mm256_cmpeq_epi8(b, f)));
+        __m256i e2 = _mm256_blendv_epi8(e, d, _mm256_andnot_si256(any, _mm256_cmpeq_epi8(d, h)));
+        __m256i e3 = _mm256_blendv_epi8(e, f, _mm256_andnot_si256(any, _mm256_cmpeq_epi8(h, f)));
+        __m256i top_lo = _mm256_unpacklo_epi8(e0, e1), top_hi = _mm256_unpackhi_epi8(e0, e1);
+        __m256i bottom_lo = _mm256_unpacklo_epi8(e2, e3), bottom_hi = _mm256_unpackhi_epi8(e2, e3);
+        _mm256_storeu_si256((__m256i*)(out0+2*x), _mm256_permute2x128_si256(top_lo, top_hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(out0+2*x+32), _mm256_permute2x128_si256(top_lo, top_hi, 0x31));
+        _mm256_storeu_si256((__m256i*)(out1+2*x), _mm256_permute2x128_si256(bottom_lo, bottom_hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(out1+2*x+32), _mm256_permute2x128_si256(bottom_lo, bottom_hi, 0x31));
+    }
+    for (; x<count; x++) scale2x_pixel(above, row, below, out0, out1, x, count);
+}
+
+
+void scale3x_row_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int count) {
+    /* compare 16 pixels at a time. SSE2 cannot interleave three vectors, so each
+    block's nine pixels are stored to a buffer and spread out one at a time */
+    if (count < 1) return;
+    scale3x_pixel(above, row, below, out0, out1, out2, 0, count);
+    int x = 1;
+    uint8_t blocks[9][16];
+    for (; x+16<=count-1; x+=16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(above+x-1));
+        __m128i b = _mm_loadu_si128((const __m128i*)(above+x));
+        __m128i c = _mm_loadu_si128((const __m128i*)(above+x+1));
+        __m128i d = _mm_loadu_si128((const __m128i*)(row+x-1));
+        __m128i e = _mm_loadu_si128((const __m128i*)(row+x));
+        __m128i f = _mm_loadu_si128((const __m128i*)(row+x+1));
+        __m128i g = _mm_loadu_si128((const __m128i*)(below+x-1));
+        __m128i h = _mm_loadu_si128((const __m128i*)(below+x));
+        __m128i i = _mm_loadu_si128((const __m128i*)(below+x+1));
+        __m128i any = _mm_or_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(d, f));
+        __m128i db = _mm_andnot_si128(any, _mm_cmpeq_epi8(d, b));
+        __m128i bf = _mm_andnot_si128(any, _mm_cmpeq_epi8(b, f));
+        __m128i dh = _mm_andnot_si128(any, _mm_cmpeq_epi8(d, h));
+        __m128i hf = _mm_andnot_si128(any, _mm_cmpeq_epi8(h, f));
+        __m128i ea = _mm_cmpeq_epi8(e, a), ec = _mm_cmpeq_epi8(e, c);
+        __m128i eg = _mm_cmpeq_epi8(e, g), ei = _mm_cmpeq_epi8(e, i);
+        _mm_storeu_si128((__m128i*)blocks[0], select_sse2(db, d, e));
+        _mm_storeu_si128((__m128i*)blocks[1], select_sse2(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e));
+        _mm_storeu_si128((__m128i*)blocks[2], select_sse2(bf, f, e));
+        _mm_storeu_si128((__m128i*)blocks[3], select_sse2(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e));
+        _mm_storeu_si128((__m128i*)blocks[4], e);
+        _mm_storeu_si128((__m128i*)blocks[5], select_sse2(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e));
+        _mm_storeu_si128((__m128i*)blocks[6], select_sse2(dh, d, e));
+        _mm_storeu_si128((__m128i*)blocks[7], select_sse2(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e));
+        _mm_storeu_si128((__m128i*)blocks[8], select_sse2(hf, f, e));
+        for (int j=0; j<16; j++) {
+            uint8_t *top = out0+3*(x+j), *middle = out1+3*(x+j), *bottom = out2+3*(x+j);
+            top[0] = blocks[0][j]; top[1] = blocks[1][j]; top[2] = blocks[2][j];
+            middle[0] = blocks[3][j]; middle[1] = blocks[4][j]; middle[2] = blocks[5][j];
+            bottom[0] = blocks[6][j]; bottom[1] = blocks[7][j]; bottom[2] = blocks[8][j];
+        }
+    }
+    for (; x<count; x++) scale3x_pixel(above, row, below, out0, out1, out2, x, count);
+}
+#endif
+
+
+void scale2x_frame(const uint8_t *shades, int width, int height, uint8_t *out) {
+    /* enlarge a frame of shades, top row first, to twice its width and height */
+    for (int y=0; y<height; y++) {
+        const uint8_t *row = shades + y*width;
+        const uint8_t *above = y > 0 ? row - width : row;
+        const uint8_t *below = y < height-1 ? row + width : row;
+        scale2x_row(above, row, below, out + 2*y*2*width, out + (2*y+1)*2*width, width);
+    }
+}
+
+
+void scale3x_frame(const uint8_t *shades, int width, int height, uint8_t *out) {
+    /* enlarge a frame of shades, top row first, to three times its width and height */
+    for (int y=0; y<height; y++) {
+        const uint8_t *row = shades + y*width;
+        const uint8_t *above = y > 0 ? row - width : row;
+        const uint8_t *below = y < height-1 ? row + width : row;
+        uint8_t *top = out + 3*y*3*width;
+        scale3x_row(above, row, below, top, top + 3*width, top + 6*width, width);
+    }
+}
+
+
+static inline uint8_t clamped_shade(const uint8_t *shades, int width, int height, int x, int y) {
+    /* get a shade from a frame, repeating the edge pixels outside it */
+    x = x < 0 ? 0 : x >= width ? width-1 : x;
+    y = y < 0 ? 0 : y >= height ? height-1 : y;
+    return shades[y*width+x];
+}
+
+
+void xbr2x_frame(const uint8_t *shades, int width, int height, const uint8_t tables[3][16], uint8_t *rgb) {
+    /* enlarge a frame of shades, top row first, to twice its size in RGB. Each corner of an enlarged
+    pixel is checked for an edge running across it, and if there is one, blended half way with the
+    nearest colour on the other side. Neighbours are named as in xBR, for the bottom right corner:
+          A1 B1 C1
+       A0 A  B  C  C4
+       D0 D  E  F  F4
+       G0 G  H  I  I4
+          G5 H5 I5
+    and the other corners use the same names rotated about E */
+    static const int directions[4][4] = {{1,0, 0,1}, {0,1, -1,0}, {-1,0, 0,-1}, {0,-1, 1,0}}; // u and v for each corner
+    int luma[16];
+    for (int s=0; s<16; s++) luma[s] = (2*tables[0][s] + 5*tables[1][s] + tables[2][s]) / 8;
+    int out_width = 2*width;
+    #define AT(a, b) clamped_shade(shades, width, height, x+(a)*vx+(b)*ux, y+(a)*vy+(b)*uy) // a steps along v, b along u
+    #define DIST(p, q) abs(luma[(p)&15] - luma[(q)&15])
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            uint8_t e = shades[y*width+x];
+            for (int corner=0; corner<4; corner++) {
+                int ux = directions[corner][0], uy = directions[corner][1];
+                int vx = directions[corner][2], vy = directions[corner][3];
+                uint8_t b = AT(-1,0), c = AT(-1,1), d = AT(0,-1), f = AT(0,1), g = AT(1,-1), h = AT(1,0), i = AT(1,1);
+                uint8_t f4 = AT(0,2), h5 = AT(2,0), i4 = AT(1,2), i5 = AT(2,1);
+                int along = DIST(e,c) + DIST(e,g) + DIST(i,f4) + DIST(i,h5) + 4*DIST(h,f);
+                int across = DIST(h,d) + DIST(h,i5) + DIST(f,i4) + DIST(f,b) + 4*DIST(e,i);
+                int corner_x = 2*x + (ux+vx > 0), corner_y = 2*y + (uy+vy > 0);
+                uint8_t *out = rgb + (corner_y*out_width + corner_x)*3;
+                uint8_t other = DIST(e,f) <= DIST(e,h) ? f : h;
+                for (int channel=0; channel<3; channel++) {
+                    if (along < across && e != f && e != h) {
+                        out[channel] = (tables[channel][e&15] + tables[channel][other&15] + 1) / 2;
+                    } else {
+                        out[channel] = tables[channel][e&15];
+                    }
+                }
+            }
+        }
+    }
+    #undef AT
+    #undef DIST
+}
+
+
+int upscale_filter_factor(int filter) {
+    /* get how many times larger a filter makes the frame */
+    switch (filter)
+    {
+    case UPSCALE_SCALE3X:
+        return 3;
+    case UPSCALE_SCALE2X:
+    case UPSCALE_XBR2X:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+
+int parse_upscale_filter(const char *name) {
+    /* get a filter from its name on the command line, or UPSCALE_NONE if it is not recognised */
+    if (!strcmp(name, "scale2x")) return UPSCALE_SCALE2X;
+    if (!strcmp(name, "scale3x")) return UPSCALE_SCALE3X;
+    if (!strcmp(name, "xbr2x")) return UPSCALE_XBR2X;
+    return UPSCALE_NONE;
+}
+
+
+void init_upscale(void) {
+    /* select the widest scaling kernels supported by the host cpu. SSE2 is always present on x86-64 */
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    scale2x_row = scale2x_row_sse2;
+    scale3x_row = scale3x_row_sse2;
+    kernel_name = "sse2";
+    if (__builtin_cpu_supports("avx2")) {
+        scale2x_row = scale2x_row_avx2;
+        kernel_name = "avx2";
+    }
+#endif
+}
+
+
+const char* upscale_kernel_name(void) {
+    /* get the name of the currently selected scale2x kernel */
+    return kernel_name;
+}
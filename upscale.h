@@ -0,0 +1,36 @@
+/* Header file for upscale.c, enlarging finished frames with pixel art filters
+  Author: Max Croucher
+  Email: mpccroucher@gmail.com
+  October 2026
+*/
+
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#define UPSCALE_NONE 0
+#define UPSCALE_SCALE2X 1
+#define UPSCALE_SCALE3X 2
+#define UPSCALE_XBR2X 3
+
+typedef void (*Scale2xRow)(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count);
+typedef void (*Scale3xRow)(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int count);
+
+extern Scale2xRow scale2x_row;
+extern Scale3xRow scale3x_row;
+
+void scale2x_row_portable(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count);
+void scale3x_row_portable(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int count);
+#ifdef __x86_64__
+void scale2x_row_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count);
+void scale2x_row_avx2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, int count);
+void scale3x_row_sse2(const uint8_t *above, const uint8_t *row, const uint8_t *below, uint8_t *out0, uint8_t *out1, uint8_t *out2, int count);
+#endif
+void scale2x_frame(const uint8_t *shades, int width, int height, uint8_t *out);
+void scale3x_frame(const uint8_t *shades, int width, int height, uint8_t *out);
+void xbr2x_frame(const uint8_t *shades, int width, int height, const uint8_t tables[3][16], uint8_t *rgb);
+int upscale_filter_factor(int filter);
+int parse_upscale_filter(const char *name);
+void init_upscale(void);
+const char* upscale_kernel_name(void);
+
+#endif // UPSCALE_H
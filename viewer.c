@@ -0,0 +1,341 @@
+/* Source file for viewer.c, the gbemu-viewer program. It shows the tilemaps, objects,
+    VRAM and PPU registers of a running emulator in its own window, reading them from
+    the shared memory segment written by gbemu --export-debug. All of the drawing is
+    done here, so the emulator runs at full speed while it is being watched.
+    Author: Max Croucher
+    Email: mpccroucher@gmail.com
+    October 2026
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <GL/freeglut.h>
+#include "debug_export.h"
+#include "tile_decode.h"
+
+#define VIEW_WIDTH 1232 // the window is laid out in these units, and scaled to its size
+#define VIEW_HEIGHT 640
+#define REFRESH_INTERVAL_MS 16
+#define SHADE_BLANK 4
+#define SHADE_MARKER 5
+#define LCDC 0x0
+#define STAT 0x1
+#define SCY 0x2
+#define SCX 0x3
+#define LY 0x4
+#define LYC 0x5
+#define BGP 0x7
+#define OBP0 0x8
+#define OBP1 0x9
+#define WY 0xA
+#define WX 0xB
+
+typedef struct {
+    GLuint texture;
+    int width;
+    int height;
+    GLubyte *pixels; // RGB, top row first
+} ViewerImage;
+
+const DebugExport *shared = NULL;
+DebugExport snapshot; // copy of the last complete frame read from the emulator
+unsigned int last_sequence = 0;
+bool have_snapshot = 0;
+GLuint label_list = 0;
+const uint8_t shades[6][3] = {{0xF8,0xF8,0xF8}, {0xA0,0xA0,0xA0}, {0x50,0x50,0x50}, {0x00,0x00,0x00}, {0xFF,0xFF,0xFF}, {0xFF,0x00,0x00}};
+
+GLubyte screen_pixels[144*160*3];
+GLubyte bg_map_pixels[256*256*3];
+GLubyte window_map_pixels[256*256*3];
+GLubyte object_pixels[16*320*3];
+GLubyte vram_pixels[3][32*256*3];
+ViewerImage screen_image = {0, 160, 144, screen_pixels};
+ViewerImage bg_map_image = {0, 256, 256, bg_map_pixels};
+ViewerImage window_map_image = {0, 256, 256, window_map_pixels};
+ViewerImage object_image = {0, 320, 16, object_pixels};
+ViewerImage vram_images[3] = {{0, 256, 32, vram_pixels[0]}, {0, 256, 32, vram_pixels[1]}, {0, 256, 32, vram_pixels[2]}};
+
+
+static bool open_export(void) {
+    /* map the emulator's shared memory segment, if it exists yet. The emulator creates it, then sizes
+    it, then sets its version, so until the size and version are both set it is tried again on the
+    next refresh. Reading it before it is sized would raise SIGBUS */
+    int fd = shm_open(DEBUG_EXPORT_NAME, O_RDONLY, 0);
+    if (fd < 0) return 0;
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < (off_t)sizeof(DebugExport)) {
+        close(fd);
+        return 0;
+    }
+    void *mapped = mmap(NULL, sizeof(DebugExport), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return 0;
+    uint32_t version = ((volatile const DebugExport*)mapped)->version;
+    if (!version) {
+        munmap(mapped, sizeof(DebugExport));
+        return 0;
+    }
+    if (version != DEBUG_EXPORT_VERSION) {
+        fprintf(stderr, "The running emulator exports a different version of the debug state\n");
+        exit(EXIT_FAILURE);
+    }
+    shared = mapped;
+    return 1;
+}
+
+
+static bool read_snapshot(void) {
+    /* copy the latest frame out of shared memory. Returns 0 if there is no new frame, or if the
+    emulator was writing while it was copied, in which case it is read again on the next refresh */
+    unsigned int sequence = atomic_load_explicit(&shared->sequence, memory_order_acquire);
+    if (sequence == last_sequence || (sequence & 1)) return 0;
+    memcpy(&snapshot, shared, sizeof(snapshot));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shared->sequence, memory_order_relaxed) != sequence) return 0;
+    last_sequence = sequence;
+    have_snapshot = 1;
+    return 1;
+}
+
+
+static void set_pixel(ViewerImage *image, int x, int y, uint8_t shade) {
+    /* set one pixel of an image to a shade */
+    memcpy(image->pixels + (y*image->width + x)*3, shades[shade], 3);
+}
+
+
+static void draw_tile(ViewerImage *image, int x, int y, uint16_t tile_addr, uint8_t palette, bool xflip, bool yflip) {
+    /* draw the tile at tile_addr into an image with its top left corner at x, y */
+    for (int row=0; row<8; row++) {
+        const uint8_t *data = snapshot.vram + tile_addr - 0x8000 + 2*(yflip ? 7-row : row);
+        uint64_t decoded = decode_tile_row(data[0], data[1]);
+        for (int col=0; col<8; col++) {
+            uint8_t colour_id = (decoded >> (8*(xflip ? 7-col : col))) & 3;
+            set_pixel(image, x+col, y+row, (palette >> (2*colour_id)) & 3);
+        }
+    }
+}
+
+
+static uint16_t tile_address(uint8_t tile_id, bool unsigned_addressing) {
+    /* get the address of a background or window tile from its id */
+    if (unsigned_addressing) return 0x8000 + tile_id*16;
+    return 0x8800 + (uint8_t)(tile_id ^ 128)*16;
+}
+
+
+static void draw_tilemap(ViewerImage *image, uint16_t map_addr) {
+    /* draw all 32x32 entries of a tilemap */
+    uint8_t lcdc = snapshot.registers[LCDC];
+    for (int i=0; i<1024; i++) {
+        uint8_t tile_id = snapshot.vram[map_addr - 0x8000 + i];
+        draw_tile(image, (i%32)*8, (i/32)*8, tile_address(tile_id, lcdc&16), snapshot.registers[BGP], 0, 0);
+    }
+}
+
+
+static void draw_viewport(void) {
+    /* outline the part of the background map shown on the screen */
+    uint8_t scx = snapshot.registers[SCX];
+    uint8_t scy = snapshot.registers[SCY];
+    for (int x=0; x<=160; x++) {
+        set_pixel(&bg_map_image, (uint8_t)(scx+x), scy, SHADE_MARKER);
+        set_pixel(&bg_map_image, (uint8_t)(scx+x), (uint8_t)(scy+144), SHADE_MARKER);
+    }
+    for (int y=0; y<144; y++) {
+        set_pixel(&bg_map_image, scx, (uint8_t)(scy+y), SHADE_MARKER);
+        set_pixel(&bg_map_image, (uint8_t)(scx+160), (uint8_t)(scy+y), SHADE_MARKER);
+    }
+}
+
+
+static void draw_objects(void) {
+    /* draw the tiles of all 40 objects side by side, with their flips and palettes */
+    bool tall = snapshot.registers[LCDC] & 4;
+    memset(object_pixels, 0xD0, sizeof(object_pixels));
+    for (int i=0; i<40; i++) {
+        const uint8_t *object = snapshot.oam + i*4;
+        uint8_t palette = snapshot.registers[(object[3] & 16) ? OBP1 : OBP0];
+        bool xflip = object[3] & 32;
+        bool yflip = object[3] & 64;
+        if (tall) {
+            uint8_t top = object[2] & 0xFE;
+            draw_tile(&object_image, i*8, 0, 0x8000 + (yflip ? top+1 : top)*16, palette, xflip, yflip);
+            draw_tile(&object_image, i*8, 8, 0x8000 + (yflip ? top : top+1)*16, palette, xflip, yflip);
+        } else {
+            draw_tile(&object_image, i*8, 0, 0x8000 + object[2]*16, palette, xflip, yflip);
+        }
+    }
+}
+
+
+static void update_images(void) {
+    /* redraw every image from the latest snapshot */
+    uint8_t lcdc = snapshot.registers[LCDC];
+    for (int y=0; y<144; y++) {
+        for (int x=0; x<160; x++) set_pixel(&screen_image, x, y, snapshot.framebuffer[y][x]);
+    }
+    draw_tilemap(&bg_map_image, (lcdc&8) ? 0x9C00 : 0x9800);
+    draw_viewport();
+    draw_tilemap(&window_map_image, (lcdc&64) ? 0x9C00 : 0x9800);
+    draw_objects();
+    for (int block=0; block<3; block++) {
+        for (int i=0; i<128; i++) {
+            draw_tile(&vram_images[block], (i%32)*8, (i/32)*8, 0x8000 + (block*128+i)*16, snapshot.registers[BGP], 0, 0);
+        }
+    }
+}
+
+
+static void show_image(ViewerImage *image, float x, float y, float scale) {
+    /* upload an image and draw it with its top left corner at x, y */
+    if (!image->texture) {
+        glGenTextures(1, &image->texture);
+        glBindTexture(GL_TEXTURE_2D, image->texture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D,0,3,image->width,image->height,0,GL_RGB, GL_UNSIGNED_BYTE, image->pixels);
+    } else {
+        glBindTexture(GL_TEXTURE_2D, image->texture);
+        glTexSubImage2D(GL_TEXTURE_2D,0,0,0,image->width,image->height,GL_RGB, GL_UNSIGNED_BYTE, image->pixels);
+    }
+    float right = x + image->width*scale;
+    float bottom = y - image->height*scale;
+    glBegin(GL_POLYGON);
+        glTexCoord2f(0,0); glVertex2f(x,y);
+        glTexCoord2f(0,1); glVertex2f(x,bottom);
+        glTexCoord2f(1,1); glVertex2f(right,bottom);
+        glTexCoord2f(1,0); glVertex2f(right,y);
+    glEnd();
+}
+
+
+static void draw_text(float x, float y, void *font, const char* string) {
+    /* draw a string on the screen */
+    glRasterPos2f(x, y);
+    glutBitmapString(font, (const unsigned char*)string);
+}
+
+
+static void draw_labels(void) {
+    /* draw the captions that never change */
+    draw_text(16, 620, GLUT_BITMAP_9_BY_15, "Screen");
+    draw_text(352, 620, GLUT_BITMAP_9_BY_15, "Background Map");
+    draw_text(624, 620, GLUT_BITMAP_9_BY_15, "Window Map");
+    draw_text(16, 300, GLUT_BITMAP_9_BY_15, "Objects 0-39");
+    const char *blocks[3] = {"0x8000-0x87FF", "0x8800-0x8FFF", "0x9000-0x97FF"};
+    for (int block=0; block<3; block++) {
+        draw_text(16, 240 - block*80, GLUT_BITMAP_9_BY_15, blocks[block]);
+    }
+}
+
+
+static void draw_registers(void) {
+    /* print the PPU registers of the latest snapshot */
+    const uint8_t *reg = snapshot.registers;
+    char string[64];
+    const char *lines[] = {"LCD Enable:    %s", "Window Map:    %s", "Window Enable: %s", "W/BG Tiledata: %s",
+        "Backround Map: %s", "OBJ Size:      %s", "OBJ Enable:    %s", "W/BG Enable:   %s"};
+    const char *values[8][2] = {{"OFF","ON"}, {"9800-9BFF","9C00-9FFF"}, {"OFF","ON"}, {"8800-97FF","8000-8FFF"},
+        {"9800-9BFF","9C00-9FFF"}, {"8x8","8x16"}, {"OFF","ON"}, {"OFF","ON"}};
+    float y = 600;
+    for (int bit=7; bit>=0; bit--, y-=20) {
+        sprintf(string, lines[7-bit], values[7-bit][(reg[LCDC]>>bit)&1]);
+        draw_text(896, y, GLUT_BITMAP_9_BY_15, string);
+    }
+    sprintf(string, "LY | LYC  = 0x%.2X | 0x%.2X", reg[LY], reg[LYC]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "STAT      = 0x%.2X", reg[STAT]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "SCX | SCY = 0x%.2X | 0x%.2X", reg[SCX], reg[SCY]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "WX+7 | WY = 0x%.2X | 0x%.2X", reg[WX], reg[WY]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "W Count   = 0x%.2X", snapshot.window_line); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "BGP       = 0x%.2X", reg[BGP]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "OBP0|OBP1 = 0x%.2X | 0x%.2X", reg[OBP0], reg[OBP1]); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "Frame     = %u", snapshot.frame); draw_text(896, y, GLUT_BITMAP_9_BY_15, string); y-=20;
+    sprintf(string, "Lag       = %u", snapshot.lag_frames); draw_text(896, y, GLUT_BITMAP_9_BY_15, string);
+}
+
+
+static void display(void) {
+    /* draw the whole window from the latest snapshot */
+    glClear(GL_COLOR_BUFFER_BIT);
+    glColor3f(1, 1, 1);
+    glEnable(GL_TEXTURE_2D);
+    show_image(&screen_image, 16, 608, 2);
+    show_image(&bg_map_image, 352, 608, 1);
+    show_image(&window_map_image, 624, 608, 1);
+    show_image(&object_image, 16, 288, 2);
+    for (int block=0; block<3; block++) show_image(&vram_images[block], 16, 228 - block*80, 2);
+    glDisable(GL_TEXTURE_2D);
+
+    glColor3f(0, 0, 0);
+    if (label_list) {
+        glCallList(label_list);
+    } else {
+        label_list = glGenLists(1);
+        glNewList(label_list, GL_COMPILE_AND_EXECUTE);
+        draw_labels();
+        glEndList();
+    }
+    if (have_snapshot) {
+        draw_registers();
+    } else {
+        draw_text(896, 600, GLUT_BITMAP_9_BY_15, "Waiting for gbemu --export-debug");
+    }
+    glutSwapBuffers();
+}
+
+
+static void reshape(int w, int h) {
+    /* stretch the layout over the whole window */
+    glViewport(0,0,(GLsizei)w, (GLsizei)h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0,VIEW_WIDTH,0,VIEW_HEIGHT,-1.0,1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+}
+
+
+static void refresh(int value) {
+    /* poll shared memory for a new frame, and redraw if there is one */
+    if (shared || open_export()) {
+        if (read_snapshot()) {
+            update_images();
+            glutPostRedisplay();
+        }
+    }
+    glutTimerFunc(REFRESH_INTERVAL_MS, refresh, 0);
+}
+
+
+static void key_pressed(unsigned char key, int x, int y) {
+    /* close the viewer with q or escape */
+    if (key == 'q' || key == 27) glutLeaveMainLoop();
+}
+
+
+int main(int argc, char *argv[]) {
+    init_tile_decode();
+    glutInit(&argc, argv);
+    glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
+    glutInitWindowSize(VIEW_WIDTH, VIEW_HEIGHT);
+    glutCreateWindow("gbemu viewer");
+    glClearColor(0.9,0.9,0.9,0.0);
+    glShadeModel(GL_FLAT);
+    glutDisplayFunc(display);
+    glutReshapeFunc(reshape);
+    glutKeyboardFunc(key_pressed);
+    glutTimerFunc(REFRESH_INTERVAL_MS, refresh, 0);
+    glutMainLoop();
+    return 0;
+}